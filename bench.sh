@@ -0,0 +1,9 @@
+#!/bin/bash
+
+# Build and run the engine benchmarks, for example:
+# ./bench.sh 10 100 1000 10000 100000
+# See src/bench/bench.c for the options.
+
+mkdir -p build
+gcc -O2 -g -pthread -DPARALLEL_GENERATION src/common/*.c src/common/math/*.c src/bench/*.c -o build/bench -lm || exit 1
+./build/bench "$@"
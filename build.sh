@@ -4,7 +4,7 @@ rm -rf build
 mkdir -p build/cgi-bin
 
 # Build server
-gcc -lm -O0 -g src/common/*.c src/common/math/*.c src/server/*.c -o build/cgi-bin/server
+gcc -lm -pthread -DPARALLEL_GENERATION -O0 -g src/common/*.c src/common/math/*.c src/server/*.c -o build/cgi-bin/server
 
 # Build web client
 # Don't use -s ALLOW_MEMORY_GROWTH=1 , it potentially invalidates pointers when it happens (transparent in wasm, but not when exporting pointers to js!
@@ -0,0 +1,3 @@
+#!/bin/bash
+cd build
+./cgi-bin/server pool
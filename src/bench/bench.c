@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/game.h"
+#include "../common/turnresolution.h"
+#include "../common/parallel.h"
+#include "../common/gamefile.h"
+
+/*
+  Times the game engine on synthetic games, generated in memory.
+
+  Usage: bench [-p players] [-o orders] [-t turns] [-s startLimit] [-f fileLimit] [-r seed] [-j threads] nodes...
+
+  For every node count given, a game with a square lattice of that many nodes
+  is built, with the nodes dealt out to the players in blocks (and every 7th
+  node left neutral). 'turns' turns of 'orders' random orders each are then
+  played. startGame is only timed for node counts up to 'startLimit' (100000
+  by default, where it takes seconds), and serialize/deserialize only up to
+  'fileLimit', since the text format grows with the square of the node count. The binary game file format is timed
+  for every node count, read as well as mapped. Map generation uses 'threads'
+  threads (by default one per core).
+
+  Every result is one tab separated line:
+  benchmark nodes players orders turns seconds
+*/
+
+static unsigned playerCountOption = 0; // 0 means one player per 6 nodes
+static unsigned orderCountOption = 0;  // 0 means one order per 2 nodes
+static unsigned turnCountOption = 20;
+static unsigned startLimit = 100000;
+static unsigned fileLimit = 5000;
+
+static double now()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void report(const char* benchmark, struct GameState* game, unsigned orderCount, double seconds)
+{
+   printf("%s\t%u\t%u\t%u\t%u\t%.6f\n", benchmark, game->nodeCount, game->playerCount,
+          orderCount, game->turnCount > 0 ? game->turnCount-1 : 0, seconds);
+   fflush(stdout);
+}
+
+// Players are added directly, as addPlayer() would spend forever looking for
+// distinct colors once there are more than a few dozen players.
+static void addBenchPlayers(struct GameState* game, unsigned playerCount)
+{
+   game->playerCount = playerCount;
+   game->playerName = malloc(playerCount * sizeof(game->playerName[0]));
+   game->playerColor = malloc(playerCount * sizeof(game->playerColor[0]));
+   game->playerSecret = malloc(playerCount * sizeof(game->playerSecret[0]));
+   for (unsigned player = 0; player < playerCount; ++player)
+   {
+      game->playerName[player] = malloc(64);
+      snprintf(game->playerName[player], 64, "bench%u", player);
+      game->playerColor[player] = malloc(8);
+      snprintf(game->playerColor[player], 8, "#%02x%02x%02x", rand()%256, rand()%256, rand()%256);
+      game->playerSecret[player] = malloc(7);
+      snprintf(game->playerSecret[player], 7, "%06u", player % 1000000);
+   }
+}
+
+static void benchStartGame(unsigned nodeCount)
+{
+   // startGame makes 6 nodes per player
+   unsigned playerCount = nodeCount / 6 > 2 ? nodeCount / 6 : 2;
+
+   struct GameState game = initatePreGame("bench");
+   strcpy(game.id, "BENCHS");
+   game.seed = rand();
+   addBenchPlayers(&game, playerCount);
+
+   double start = now();
+   startGame(&game);
+   report("startGame", &game, 0, now() - start);
+   if (countIslands(&game) != 1)
+      fprintf(stderr, "startGame left %u islands\n", countIslands(&game));
+
+   freeGameState(&game);
+}
+
+static struct GameState createLatticeGame(unsigned nodeCount, unsigned playerCount)
+{
+   struct GameState game = initatePreGame("bench");
+   strcpy(game.id, "BENCHL");
+   addBenchPlayers(&game, playerCount);
+   game.metaGameState = INGAME;
+   game.nodeCount = nodeCount;
+
+   // Each node connects to its neighbours left, right, above and below
+   unsigned width = 1;
+   while (width * width < nodeCount)
+      ++width;
+   game.adjacencyOffsets = malloc((nodeCount + 1) * sizeof(game.adjacencyOffsets[0]));
+   game.adjacencyList = malloc(4 * nodeCount * sizeof(game.adjacencyList[0]));
+   game.nodeSpacePositions = malloc(nodeCount * sizeof(game.nodeSpacePositions[0]));
+   game.adjacencyOffsets[0] = 0;
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      unsigned edge = game.adjacencyOffsets[node];
+      if (node >= width)
+         game.adjacencyList[edge++] = node - width;
+      if (node % width > 0)
+         game.adjacencyList[edge++] = node - 1;
+      if (node % width < width - 1 && node + 1 < nodeCount)
+         game.adjacencyList[edge++] = node + 1;
+      if (node + width < nodeCount)
+         game.adjacencyList[edge++] = node + width;
+      game.adjacencyOffsets[node+1] = edge;
+
+      game.nodeSpacePositions[node].x = (float)(node % width) / width * 2.0 - 1.0;
+      game.nodeSpacePositions[node].y = (float)(node / width) / width * 2.0 - 1.0;
+      game.nodeSpacePositions[node].z = 0.0;
+      game.nodeSpacePositions[node].w = 1.0;
+   }
+
+   game.controlledBy = malloc(nodeCount * sizeof(game.controlledBy[0]));
+   game.controlledByInitial = malloc(nodeCount * sizeof(game.controlledByInitial[0]));
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      game.controlledByInitial[node] = node % 7 == 0 ? UINT_MAX : (unsigned long long)node * playerCount / nodeCount;
+   }
+   memcpy(game.controlledBy, game.controlledByInitial, nodeCount * sizeof(game.controlledBy[0]));
+
+   game.turnCount = 1;
+   game.turn = calloc(game.turnCount, sizeof(game.turn[0]));
+   return game;
+}
+
+// Gives 'orderCount' random orders from controlled nodes to their neighbours.
+// Written straight into the turn, as addOrder() looks through all orders given
+// so far for every new one.
+static void addRandomOrders(struct GameState* game, unsigned orderCount)
+{
+   struct Turn* turn = &game->turn[game->turnCount-1];
+   turn->issuingPlayer = realloc(turn->issuingPlayer, orderCount * sizeof(turn->issuingPlayer[0]));
+   turn->fromNode = realloc(turn->fromNode, orderCount * sizeof(turn->fromNode[0]));
+   turn->toNode = realloc(turn->toNode, orderCount * sizeof(turn->toNode[0]));
+   turn->type = realloc(turn->type, orderCount * sizeof(turn->type[0]));
+   turn->orderCount = 0;
+
+   for (unsigned attempt = 0; attempt < 4 * orderCount && turn->orderCount < orderCount; ++attempt)
+   {
+      unsigned from = rand() % game->nodeCount;
+      unsigned player = game->controlledBy[from];
+      unsigned connectedCount = getConnectedCount(game, from);
+      if (player == UINT_MAX || !connectedCount)
+         continue;
+      unsigned to = game->adjacencyList[game->adjacencyOffsets[from] + rand() % connectedCount];
+
+      turn->issuingPlayer[turn->orderCount] = player;
+      turn->fromNode[turn->orderCount] = from;
+      turn->toNode[turn->orderCount] = to;
+      turn->type[turn->orderCount] = game->controlledBy[to] == player ? SUPPORTORDER : ATTACKORDER;
+      turn->orderCount++;
+   }
+}
+
+static void benchLatticeGame(unsigned nodeCount)
+{
+   unsigned playerCount = playerCountOption ? playerCountOption : (nodeCount / 6 > 2 ? nodeCount / 6 : 2);
+   unsigned orderCount = orderCountOption ? orderCountOption : (nodeCount / 2 > 1 ? nodeCount / 2 : 1);
+
+   struct GameState game = createLatticeGame(nodeCount, playerCount);
+   for (unsigned turn = 0; turn < turnCountOption && game.metaGameState == INGAME; ++turn)
+   {
+      stepGameHistoryLatest(&game);
+      addRandomOrders(&game, orderCount);
+      tickGame(&game);
+   }
+
+   // The whole history, without any checkpoints to start from
+   free(game.checkpoints);
+   game.checkpoints = NULL;
+   game.checkpointCount = 0;
+   double start = now();
+   stepGameHistoryLatest(&game);
+   report("stepGameHistory", &game, orderCount, now() - start);
+
+   // And again, now that the checkpoints are there
+   start = now();
+   stepGameHistoryLatest(&game);
+   report("stepGameHistoryCheckpointed", &game, orderCount, now() - start);
+
+   if (game.turnCount > 1)
+   {
+      float* strength = malloc(nodeCount * sizeof(strength[0]));
+      unsigned* splitCount = malloc(nodeCount * sizeof(splitCount[0]));
+      start = now();
+      calculateDisplayStrengths(&game, game.turnCount-2, strength, splitCount);
+      report("calculateDisplayStrengths", &game, orderCount, now() - start);
+      free(strength);
+      free(splitCount);
+   }
+
+   if (nodeCount <= fileLimit)
+   {
+      char* buffer = NULL;
+      size_t size = 0;
+      FILE* f = open_memstream(&buffer, &size);
+      start = now();
+      serialize(&game, -1, f);
+      fflush(f);
+      report("serialize", &game, orderCount, now() - start);
+      fclose(f);
+
+      f = fmemopen(buffer, size, "r");
+      start = now();
+      struct GameState loaded = deserialize(f);
+      report("deserialize", &game, orderCount, now() - start);
+      fclose(f);
+      freeGameState(&loaded);
+      free(buffer);
+   }
+
+   {
+      char* buffer = NULL;
+      size_t size = 0;
+      FILE* f = open_memstream(&buffer, &size);
+      start = now();
+      writeGameFile(&game, f);
+      fflush(f);
+      report("writeGameFile", &game, orderCount, now() - start);
+      fclose(f);
+
+      f = fmemopen(buffer, size, "r");
+      struct GameState loaded;
+      start = now();
+      if (!readGameFile(f, &loaded))
+         fprintf(stderr, "readGameFile failed\n");
+      report("readGameFile", &game, orderCount, now() - start);
+      fclose(f);
+      freeGameState(&loaded);
+
+      // Mapping needs a real file
+      char path[] = "/tmp/benchXXXXXX";
+      int fd = mkstemp(path);
+      if (fd != -1 && write(fd, buffer, size) == (ssize_t)size)
+      {
+         start = now();
+         if (!mapGameFile(path, &loaded))
+            fprintf(stderr, "mapGameFile failed\n");
+         report("mapGameFile", &game, orderCount, now() - start);
+         freeGameState(&loaded);
+      }
+      if (fd != -1)
+      {
+         close(fd);
+         unlink(path);
+      }
+      free(buffer);
+   }
+
+   freeGameState(&game);
+}
+
+int main(int argc, char** argv)
+{
+   unsigned seed = 1;
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   setParallelThreadCount(cores > 0 ? cores : 1);
+   int option;
+   while ((option = getopt(argc, argv, "p:o:t:s:f:r:j:")) != -1)
+   {
+      switch (option)
+      {
+         case 'p': playerCountOption = strtoul(optarg, NULL, 10); break;
+         case 'o': orderCountOption = strtoul(optarg, NULL, 10); break;
+         case 't': turnCountOption = strtoul(optarg, NULL, 10); break;
+         case 's': startLimit = strtoul(optarg, NULL, 10); break;
+         case 'f': fileLimit = strtoul(optarg, NULL, 10); break;
+         case 'r': seed = strtoul(optarg, NULL, 10); break;
+         case 'j': setParallelThreadCount(strtoul(optarg, NULL, 10)); break;
+         default:
+            fprintf(stderr, "Usage: %s [-p players] [-o orders] [-t turns] [-s startLimit] [-f fileLimit] [-r seed] [-j threads] nodes...\n", argv[0]);
+            return 1;
+      }
+   }
+
+   printf("benchmark\tnodes\tplayers\torders\tturns\tseconds\n");
+   for (int i = optind; i < argc; ++i)
+   {
+      unsigned nodeCount = strtoul(argv[i], NULL, 10);
+      if (nodeCount < 2)
+         continue;
+
+      srand(seed);
+      if (nodeCount <= startLimit)
+         benchStartGame(nodeCount);
+      benchLatticeGame(nodeCount);
+   }
+
+   return 0;
+}
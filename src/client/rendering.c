@@ -33,7 +33,6 @@ void renderGraph(unsigned nodeFocus, float viewEulerX, float viewEulerY,
    Vec4* nodes = clientState.state.nodeSpacePositions;
    Vec3* transformed = clientState.nodeScreenPositions;
    
-   unsigned* adjacencyMatrix = clientState.state.adjacencyMatrix;
    unsigned nodeCount = clientState.state.nodeCount;
 
    float aspect = screenWidth / screenHeight;
@@ -10,6 +10,35 @@
 
 extern struct ClientGame clientState; // client.c
 
+// What the list of games has of each game
+struct GameSummary
+{
+   char id[7];
+   char gameName[64];
+   enum MetaGameState metaGameState;
+   unsigned playerCount;
+   char winningName[64];
+};
+
+// Reads a line without its newline, cutting it short if it doesn't fit
+static void readLine(FILE* f, char* line, size_t size)
+{
+   if (!fgets(line, size, f))
+   {
+      line[0] = '\0';
+      return;
+   }
+   size_t length = strlen(line);
+   if (length && line[length-1] == '\n')
+      line[length-1] = '\0';
+   else
+   {
+      int c;
+      while ((c = fgetc(f)) != EOF && c != '\n')
+         ;
+   }
+}
+
 static void receiveGames(const char* data, unsigned size)
 {
    // Why, right? Well, reading the buffer directly means we have to deal with
@@ -31,7 +60,16 @@ static void receiveGames(const char* data, unsigned size)
    // Open games list
    for (unsigned i = 0; i < gameCount; ++i)
    {
-      struct GameState game = deserialize(f);
+      // Each game is its id, name, state, player count and winner, a line each
+      struct GameSummary game;
+      readLine(f, game.id, sizeof(game.id));
+      readLine(f, game.gameName, sizeof(game.gameName));
+      char number[16];
+      readLine(f, number, sizeof(number));
+      game.metaGameState = atoi(number);
+      readLine(f, number, sizeof(number));
+      game.playerCount = strtoul(number, NULL, 10);
+      readLine(f, game.winningName, sizeof(game.winningName));
 
       switch (game.metaGameState)
       {
@@ -75,9 +113,9 @@ static void receiveGames(const char* data, unsigned size)
 
          case POSTGAME:
 	 {
-            char* winningName = "INDECIVSIE";
-            if (game.winningPlayer != UINT_MAX)
-               winningName = game.playerName[game.winningPlayer];
+            const char* winningName = "INDECIVSIE";
+            if (game.winningName[0])
+               winningName = game.winningName;
             
 	    fprintf(htmlF, " \
 <div class=\"game-entry\"> \
@@ -6,21 +6,282 @@
 
 #include "math/vec.h"
 #include "game.h"
+#include "gamefile.h"
+#include "random.h"
+#include "parallel.h"
 
 static const unsigned MAXCONNECTIONS = 4;
 static const unsigned MINCONNECTIONS = 2;
 static const unsigned NODESPERPLAYER = 6;
 
-static void disconnectNodes(struct GameState* state, unsigned a, unsigned b)
+// While the map is being generated, edges come and go, which the compressed
+// rows of the game state are no good at. So until the map is done, every node
+// gets a fixed number of slots instead (a node may temporarily go two above
+// MAXCONNECTIONS while islands are being connected).
+#define MAPGRAPHSLOTS (MAXCONNECTIONS + 2)
+
+struct MapGraph
+{
+   unsigned nodeCount;
+   unsigned* degree;
+   unsigned* neighbours; // MAPGRAPHSLOTS per node, kept in ascending order
+};
+
+static struct MapGraph createMapGraph(unsigned nodeCount)
+{
+   struct MapGraph graph;
+   graph.nodeCount = nodeCount;
+   graph.degree = calloc(nodeCount, sizeof(graph.degree[0]));
+   graph.neighbours = calloc(nodeCount * MAPGRAPHSLOTS, sizeof(graph.neighbours[0]));
+   return graph;
+}
+
+static void freeMapGraph(struct MapGraph* graph)
+{
+   free(graph->degree);
+   free(graph->neighbours);
+}
+
+static unsigned graphNodesConnect(const struct MapGraph* graph, unsigned a, unsigned b)
+{
+   const unsigned* row = &graph->neighbours[a * MAPGRAPHSLOTS];
+   for (unsigned i = 0; i < graph->degree[a]; ++i)
+   {
+      if (row[i] == b)
+         return 1;
+   }
+   return 0;
+}
+
+static void insertNeighbour(struct MapGraph* graph, unsigned a, unsigned b)
+{
+   unsigned* row = &graph->neighbours[a * MAPGRAPHSLOTS];
+   unsigned i = graph->degree[a]++;
+   while (i > 0 && row[i-1] > b)
+   {
+      row[i] = row[i-1];
+      --i;
+   }
+   row[i] = b;
+}
+
+static void removeNeighbour(struct MapGraph* graph, unsigned a, unsigned b)
+{
+   unsigned* row = &graph->neighbours[a * MAPGRAPHSLOTS];
+   for (unsigned i = 0; i < graph->degree[a]; ++i)
+   {
+      if (row[i] == b)
+      {
+         memmove(&row[i], &row[i+1], (graph->degree[a] - i - 1) * sizeof(row[0]));
+         graph->degree[a]--;
+         return;
+      }
+   }
+}
+
+static void disconnectNodes(struct MapGraph* graph, unsigned a, unsigned b)
+{
+   removeNeighbour(graph, a, b);
+   removeNeighbour(graph, b, a);
+}
+
+static void connectNodes(struct MapGraph* graph, unsigned a, unsigned b)
+{
+   if (graphNodesConnect(graph, a, b))
+      return;
+   insertNeighbour(graph, a, b);
+   insertNeighbour(graph, b, a);
+}
+
+// Pack the finished map graph into the game states compressed rows
+static void storeMapGraph(struct GameState* state, const struct MapGraph* graph)
+{
+   unsigned edgeEnds = 0;
+   for (unsigned node = 0; node < graph->nodeCount; ++node)
+      edgeEnds += graph->degree[node];
+
+   state->adjacencyOffsets = malloc(sizeof(state->adjacencyOffsets[0]) * (graph->nodeCount + 1));
+   state->adjacencyList = malloc(sizeof(state->adjacencyList[0]) * edgeEnds);
+
+   state->adjacencyOffsets[0] = 0;
+   for (unsigned node = 0; node < graph->nodeCount; ++node)
+   {
+      unsigned offset = state->adjacencyOffsets[node];
+      memcpy(&state->adjacencyList[offset], &graph->neighbours[node * MAPGRAPHSLOTS],
+             graph->degree[node] * sizeof(state->adjacencyList[0]));
+      state->adjacencyOffsets[node+1] = offset + graph->degree[node];
+   }
+}
+
+// A uniform grid over the node positions, for finding nearby nodes without
+// looking at all of them. Each cell holds the nodes inside it, and nodes can
+// be taken out of the grid (but not put back) once nobody should find them.
+struct SpatialGrid
+{
+   unsigned cellsPerAxis;
+   float cellSize;
+   Vec3 origin;
+   unsigned* cellStart; // cellsPerAxis^3 + 1, nodes of cell c are cellNodes[cellStart[c]] ..
+   unsigned* cellCount; // .. up to (but not including) cellNodes[cellStart[c] + cellCount[c]]
+   unsigned* cellNodes;
+   unsigned* nodeCell;
+   unsigned* nodeSlot;  // where in cellNodes each node is
+};
+
+static unsigned gridAxisCell(const struct SpatialGrid* grid, float position, float origin)
+{
+   int cell = (int)((position - origin) / grid->cellSize);
+   if (cell < 0)
+      return 0;
+   if (cell >= (int)grid->cellsPerAxis)
+      return grid->cellsPerAxis - 1;
+   return cell;
+}
+
+static struct SpatialGrid createSpatialGrid(const Vec4* positions, unsigned nodeCount)
+{
+   struct SpatialGrid grid;
+
+   // Around two nodes per cell
+   grid.cellsPerAxis = 1;
+   while (2 * grid.cellsPerAxis * grid.cellsPerAxis * grid.cellsPerAxis < nodeCount)
+      ++grid.cellsPerAxis;
+
+   // An empty grid (of one empty cell) when there are no nodes at all
+   Vec3 low = {0.0f, 0.0f, 0.0f}, high = low;
+   if (nodeCount)
+      low = high = V4toV3(positions[0]);
+   for (unsigned node = 1; node < nodeCount; ++node)
+   {
+      low.x = fminf(low.x, positions[node].x); high.x = fmaxf(high.x, positions[node].x);
+      low.y = fminf(low.y, positions[node].y); high.y = fmaxf(high.y, positions[node].y);
+      low.z = fminf(low.z, positions[node].z); high.z = fmaxf(high.z, positions[node].z);
+   }
+   float extent = fmaxf(high.x - low.x, fmaxf(high.y - low.y, high.z - low.z));
+   grid.origin = low;
+   grid.cellSize = (extent > 0.0f ? extent * 1.0001f : 1.0f) / grid.cellsPerAxis;
+
+   unsigned cellCount = grid.cellsPerAxis * grid.cellsPerAxis * grid.cellsPerAxis;
+   grid.cellStart = calloc(cellCount + 1, sizeof(grid.cellStart[0]));
+   grid.cellCount = calloc(cellCount, sizeof(grid.cellCount[0]));
+   grid.cellNodes = malloc(nodeCount * sizeof(grid.cellNodes[0]));
+   grid.nodeCell = malloc(nodeCount * sizeof(grid.nodeCell[0]));
+   grid.nodeSlot = malloc(nodeCount * sizeof(grid.nodeSlot[0]));
+
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      unsigned x = gridAxisCell(&grid, positions[node].x, grid.origin.x);
+      unsigned y = gridAxisCell(&grid, positions[node].y, grid.origin.y);
+      unsigned z = gridAxisCell(&grid, positions[node].z, grid.origin.z);
+      grid.nodeCell[node] = (z * grid.cellsPerAxis + y) * grid.cellsPerAxis + x;
+      ++grid.cellStart[grid.nodeCell[node] + 1];
+   }
+   for (unsigned cell = 0; cell < cellCount; ++cell)
+   {
+      grid.cellStart[cell + 1] += grid.cellStart[cell];
+   }
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      unsigned cell = grid.nodeCell[node];
+      grid.nodeSlot[node] = grid.cellStart[cell] + grid.cellCount[cell]++;
+      grid.cellNodes[grid.nodeSlot[node]] = node;
+   }
+
+   return grid;
+}
+
+static void freeSpatialGrid(struct SpatialGrid* grid)
+{
+   free(grid->cellStart);
+   free(grid->cellCount);
+   free(grid->cellNodes);
+   free(grid->nodeCell);
+   free(grid->nodeSlot);
+}
+
+static void removeFromSpatialGrid(struct SpatialGrid* grid, unsigned node)
+{
+   unsigned cell = grid->nodeCell[node];
+   if (grid->nodeSlot[node] == UINT_MAX)
+      return;
+
+   // Swap the last node of the cell into the removed ones place
+   unsigned last = grid->cellStart[cell] + --grid->cellCount[cell];
+   unsigned lastNode = grid->cellNodes[last];
+   grid->cellNodes[grid->nodeSlot[node]] = lastNode;
+   grid->nodeSlot[lastNode] = grid->nodeSlot[node];
+   grid->nodeSlot[node] = UINT_MAX;
+}
+
+static float nodeDistance(const Vec4* positions, unsigned a, unsigned b)
 {
-   state->adjacencyMatrix[a * state->nodeCount + b] = 0;
-   state->adjacencyMatrix[b * state->nodeCount + a] = 0;
+   return sqrt(V3SqrDist(V4toV3(positions[a]), V4toV3(positions[b])));
 }
 
-static void connectNodes(struct GameState* state, unsigned a, unsigned b)
+/*
+  Finds the node in the grid closest to 'node' that 'accept' says yes to, or
+  UINT_MAX if there is none. Ties go to the lowest numbered node, so the
+  result is the same as that of scanning all nodes in order for the closest.
+  '*distance' is set to the distance to the node found.
+
+  Cells are searched in shells of growing size around the cell of 'node',
+  until the next shell can't possibly hold anything closer.
+*/
+static unsigned nearestInSpatialGrid(const struct SpatialGrid* grid, const Vec4* positions, unsigned node,
+                                     int (*accept)(unsigned candidate, void* context), void* context,
+                                     float* distance)
 {
-   state->adjacencyMatrix[a * state->nodeCount + b] = 1;
-   state->adjacencyMatrix[b * state->nodeCount + a] = 1;
+   int n = grid->cellsPerAxis;
+   int cx = gridAxisCell(grid, positions[node].x, grid->origin.x);
+   int cy = gridAxisCell(grid, positions[node].y, grid->origin.y);
+   int cz = gridAxisCell(grid, positions[node].z, grid->origin.z);
+
+   unsigned nearest = UINT_MAX;
+   float nearestDistance = 0.0f;
+   for (int shell = 0; shell < n; ++shell)
+   {
+      // Anything in this shell is at least (shell-1) cells away (with a little
+      // margin, for the rounding of the distances)
+      if (nearest != UINT_MAX && (shell - 1) * grid->cellSize > nearestDistance * 1.0001f + 1e-6f)
+         break;
+
+      for (int z = cz - shell; z <= cz + shell; ++z)
+      {
+         if (z < 0 || z >= n)
+            continue;
+         for (int y = cy - shell; y <= cy + shell; ++y)
+         {
+            if (y < 0 || y >= n)
+               continue;
+            // Inside the shell, only the first and last x are on its surface
+            int onSurface = z == cz - shell || z == cz + shell || y == cy - shell || y == cy + shell;
+            int xStep = onSurface || shell == 0 ? 1 : 2 * shell;
+            for (int x = cx - shell; x <= cx + shell; x += xStep)
+            {
+               if (x < 0 || x >= n)
+                  continue;
+
+               unsigned cell = (z * n + y) * n + x;
+               for (unsigned i = 0; i < grid->cellCount[cell]; ++i)
+               {
+                  unsigned candidate = grid->cellNodes[grid->cellStart[cell] + i];
+                  if (candidate == node || !accept(candidate, context))
+                     continue;
+                  float candidateDistance = nodeDistance(positions, node, candidate);
+                  if (nearest == UINT_MAX || candidateDistance < nearestDistance ||
+                      (candidateDistance == nearestDistance && candidate < nearest))
+                  {
+                     nearest = candidate;
+                     nearestDistance = candidateDistance;
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   *distance = nearestDistance;
+   return nearest;
 }
 
 struct GameState initatePreGame(const char* gameName)
@@ -35,31 +296,51 @@ struct GameState initatePreGame(const char* gameName)
    return state;
 }
 
-static void findIsland(struct GameState* state, unsigned node, unsigned* visited)
+// Union-find over the nodes, for keeping track of which island each node is on
+struct IslandSet
 {
-   if (visited[node])
-      return;
-   
-   visited[node] = 1;
+   unsigned* parent;
+   unsigned* size;
+   unsigned count; // the number of islands
+};
 
-   unsigned connected[MAXCONNECTIONS];
-   unsigned connectedCount = 0;
-   getConnectedNodes(state, node, connected, &connectedCount);
+static struct IslandSet createIslandSet(struct Scratch* scratch, unsigned nodeCount)
+{
+   struct IslandSet islands;
+   islands.parent = scratchAlloc(scratch, nodeCount * sizeof(islands.parent[0]));
+   islands.size = scratchAlloc(scratch, nodeCount * sizeof(islands.size[0]));
+   islands.count = nodeCount;
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      islands.parent[node] = node;
+      islands.size[node] = 1;
+   }
+   return islands;
+}
 
-   for (unsigned connectedNode = 0; connectedNode < connectedCount; ++connectedNode)
+static unsigned findIsland(struct IslandSet* islands, unsigned node)
+{
+   while (islands->parent[node] != node)
    {
-      findIsland(state, connected[connectedNode], visited);
+      islands->parent[node] = islands->parent[islands->parent[node]];
+      node = islands->parent[node];
    }
+   return node;
 }
 
-static int islandIsComplete(unsigned* visited, unsigned nodeCount)
+static void joinIslands(struct IslandSet* islands, unsigned a, unsigned b)
 {
-   for (unsigned i = 0; i < nodeCount; ++i)
+   a = findIsland(islands, a);
+   b = findIsland(islands, b);
+   if (a == b)
+      return;
+   if (islands->size[a] < islands->size[b])
    {
-      if (!visited[i])
-         return 0;
+      unsigned swap = a; a = b; b = swap;
    }
-   return 1;
+   islands->parent[b] = a;
+   islands->size[a] += islands->size[b];
+   --islands->count;
 }
 
 static Vec3 colorVec(char* color)
@@ -89,6 +370,7 @@ static void ensureAcceptableColor(struct GameState* game, char* color)
    // the game itself and neutral worlds).
 
    Vec3 vChosenColor = colorVec(color);
+   struct Random random = seedRandom(game->seed ^ (game->playerCount * 0x9E3779B97F4A7C15ull));
 
    unsigned hadToChange = 1;
    while (hadToChange)
@@ -97,7 +379,7 @@ static void ensureAcceptableColor(struct GameState* game, char* color)
 
       Vec3 white = {256, 256, 256};
       Vec3 black = {0, 0, 0};
-      Vec3 randomColor = {rand()%256, rand()%256, rand()%256};
+      Vec3 randomColor = {nextRandom(&random)%256, nextRandom(&random)%256, nextRandom(&random)%256};
 
       Vec3 cp = V3ScalarMult(1.0f / 256.0f, vChosenColor);
       float luminance = sqrt( 0.299*cp.x*cp.x +
@@ -128,176 +410,361 @@ static void ensureAcceptableColor(struct GameState* game, char* color)
             (unsigned) vChosenColor.z);
 }
 
-static void connectIslands(struct GameState* state)
+struct IslandQuery
+{
+   const struct MapGraph* graph;
+   struct IslandSet* islands;
+   unsigned island;
+   const unsigned char* islandHasRoom; // if set, also accept full nodes on islands where every node is full
+};
+
+static int acceptOtherIsland(unsigned candidate, void* context)
+{
+   struct IslandQuery* query = context;
+   unsigned island = findIsland(query->islands, candidate);
+   return island != query->island &&
+      (query->graph->degree[candidate] < MAXCONNECTIONS ||
+       (query->islandHasRoom && !query->islandHasRoom[island]));
+}
+
+struct Bridge
 {
-   unsigned currentIsland[state->nodeCount];
-   memset(currentIsland, 0, state->nodeCount * sizeof(currentIsland[0]));
-   findIsland(state, 0, currentIsland);
+   float distance;
+   unsigned a, b;
+};
+
+static int compareBridges(const void* first, const void* second)
+{
+   const struct Bridge* x = first;
+   const struct Bridge* y = second;
+   if (x->distance != y->distance)
+      return x->distance < y->distance ? -1 : 1;
+   if (x->a != y->a)
+      return x->a < y->a ? -1 : 1;
+   return (x->b > y->b) - (x->b < y->b);
+}
+
+/*
+  Joins all islands into one, with the shortest bridges that keep every node
+  within MAXCONNECTIONS. In rounds: every node with room to spare proposes a
+  bridge to the closest node with room on another island, and the proposals
+  are then built shortest first (Kruskal style), skipping those joining
+  islands already joined. Every round at least halves the number of islands.
+*/
+static void connectIslands(struct GameState* state, struct MapGraph* graph)
+{
+   struct Scratch* scratch = &state->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned nodeCount = state->nodeCount;
+
+   struct IslandSet islands = createIslandSet(scratch, nodeCount);
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      for (unsigned i = 0; i < graph->degree[node]; ++i)
+         joinIslands(&islands, node, graph->neighbours[node * MAPGRAPHSLOTS + i]);
+   }
 
-   while (!islandIsComplete(currentIsland, state->nodeCount))
+   struct SpatialGrid grid = createSpatialGrid(state->nodeSpacePositions, nodeCount);
+   struct Bridge* bridges = scratchAlloc(scratch, nodeCount * sizeof(bridges[0]));
+   while (islands.count > 1)
    {
-      // Find the closest 2 pairs of nodes, each with one node _on_ the island, and one part _off_.
-      // This shit is n^2, but thats ok, the graphs are small.
-      float shortestDist[2] = {999998.0, 999999.0};
-      unsigned nearestNodes[4];
-      for (unsigned i = 0; i < state->nodeCount; ++i)
+      unsigned bridgeCount = 0;
+      for (unsigned node = 0; node < nodeCount; ++node)
       {
-         if (currentIsland[i])
-         {
-            for (unsigned j = 0; j < state->nodeCount; ++j)
-            {
-               if (!currentIsland[j])
-               {
-                  if (i == j)
-                     continue;
-            
-                  float dist = V3SqrDist(V4toV3(state->nodeSpacePositions[i]), V4toV3(state->nodeSpacePositions[j]));
-                  if (dist < shortestDist[0])
-                  {
-                     shortestDist[0] = dist;
-                     nearestNodes[0] = i;
-                     nearestNodes[1] = j;
-                  }
-                  else if (dist < shortestDist[1])
-                  {
-                     shortestDist[1] = dist;
-                     nearestNodes[2] = i;
-                     nearestNodes[3] = j;
-                  }
-               }
-            }
-         }
+         if (graph->degree[node] >= MAXCONNECTIONS)
+            continue;
+
+         struct IslandQuery query = {graph, &islands, findIsland(&islands, node), NULL};
+         struct Bridge bridge = {0.0f, node, UINT_MAX};
+         bridge.b = nearestInSpatialGrid(&grid, state->nodeSpacePositions, node,
+                                         acceptOtherIsland, &query, &bridge.distance);
+         if (bridge.b != UINT_MAX)
+            bridges[bridgeCount++] = bridge;
       }
-      
-      connectNodes(state, nearestNodes[0], nearestNodes[1]);
-      connectNodes(state, nearestNodes[2], nearestNodes[3]);
 
-      for (unsigned i = 0; i < 4; ++i)
+      if (!bridgeCount)
       {
-         unsigned node = nearestNodes[i];
-         unsigned connected[MAXCONNECTIONS+2];
-         unsigned connectedCount = 0;
-         getConnectedNodes(state, node, connected, &connectedCount);
-         while (connectedCount > MAXCONNECTIONS)
+         // Every island but (at most) one is full. Full islands have exactly
+         // MAXCONNECTIONS (an even number) edges on every node, so none of
+         // their edges is the only way across them. Bridge the closest pair
+         // anyway, with ends that have room or are on a full island, and
+         // take one of the old edges off every full end. A full node on the
+         // island that is not full could be losing the only way across it.
+         struct ScratchPosition roomPosition = scratchSave(scratch);
+         unsigned char* islandHasRoom = scratchAlloc(scratch, nodeCount);
+         memset(islandHasRoom, 0, nodeCount);
+         for (unsigned node = 0; node < nodeCount; ++node)
+         {
+            if (graph->degree[node] < MAXCONNECTIONS)
+               islandHasRoom[findIsland(&islands, node)] = 1;
+         }
+
+         struct Bridge closest = {0.0f, UINT_MAX, UINT_MAX};
+         for (unsigned node = 0; node < nodeCount; ++node)
          {
-            disconnectNodes(state, node, connected[rand()%connectedCount]);
-            getConnectedNodes(state, node, connected, &connectedCount);
+            unsigned island = findIsland(&islands, node);
+            if (graph->degree[node] >= MAXCONNECTIONS && islandHasRoom[island])
+               continue;
+            struct IslandQuery query = {graph, &islands, island, islandHasRoom};
+            struct Bridge bridge = {0.0f, node, UINT_MAX};
+            bridge.b = nearestInSpatialGrid(&grid, state->nodeSpacePositions, node,
+                                            acceptOtherIsland, &query, &bridge.distance);
+            if (bridge.b != UINT_MAX && (closest.a == UINT_MAX || compareBridges(&bridge, &closest) < 0))
+               closest = bridge;
          }
+
+         unsigned ends[2] = {closest.a, closest.b};
+         for (unsigned i = 0; i < 2; ++i)
+         {
+            if (graph->degree[ends[i]] >= MAXCONNECTIONS)
+               disconnectNodes(graph, ends[i], graph->neighbours[ends[i] * MAPGRAPHSLOTS]);
+         }
+         connectNodes(graph, closest.a, closest.b);
+         joinIslands(&islands, closest.a, closest.b);
+         scratchRestore(scratch, roomPosition);
+         continue;
+      }
+
+      qsort(bridges, bridgeCount, sizeof(bridges[0]), compareBridges);
+      for (unsigned i = 0; i < bridgeCount; ++i)
+      {
+         unsigned a = bridges[i].a, b = bridges[i].b;
+         if (findIsland(&islands, a) == findIsland(&islands, b) ||
+             graph->degree[a] >= MAXCONNECTIONS ||
+             graph->degree[b] >= MAXCONNECTIONS)
+            continue;
+         connectNodes(graph, a, b);
+         joinIslands(&islands, a, b);
       }
-   
-      memset(currentIsland, 0, state->nodeCount * sizeof(currentIsland[0]));
-      findIsland(state, 0, currentIsland);
    }
+
+   freeSpatialGrid(&grid);
+   scratchRestore(scratch, position);
 }
 
-static unsigned topologicalDistance(struct GameState* state, unsigned a, unsigned b)
+// Fills 'distance' with the number of hops from 'a' to every node (UINT_MAX
+// for nodes that can't be reached). 'queue' must have room for every node.
+static void topologicalDistances(const struct MapGraph* graph, unsigned* queue, unsigned a, unsigned* distance)
 {
-   // Do BFS for shortest distance between a and b
-   unsigned queue[state->nodeCount];
-   unsigned visited[state->nodeCount];
-   memset(visited, 0, sizeof(visited[0]) * state->nodeCount);
-   unsigned head = 0, tail = 0, depth = 0, remainingAtDepth = 1;
+   unsigned head = 0, tail = 0;
 
-   // For getConnected
-   unsigned connected[MAXCONNECTIONS];
-   unsigned connectedCount = 0;
-   
+   for (unsigned node = 0; node < graph->nodeCount; ++node)
+      distance[node] = UINT_MAX;
+   distance[a] = 0;
    queue[head++] = a;
-   visited[a] = 1;
-   while (head != tail)
+
+   // Every node is queued at most once, so the queue never wraps
+   while (tail != head)
    {
-      // Get a node from queue
-      unsigned node = queue[tail];
-      if (++tail == state->nodeCount) tail = 0;
+      unsigned node = queue[tail++];
+      const unsigned* row = &graph->neighbours[node * MAPGRAPHSLOTS];
+      for (unsigned i = 0; i < graph->degree[node]; ++i)
+      {
+         if (distance[row[i]] != UINT_MAX)
+            continue;
+         distance[row[i]] = distance[node] + 1;
+         queue[head++] = row[i];
+      }
+   }
+}
+
+// The distance table of connectFarthestPairs, and what its parallel parts share
+struct FarthestPairs
+{
+   const struct MapGraph* graph;
+   unsigned nodeCount;
+   const unsigned* row;
+   unsigned* distance;
+   unsigned* queue; // one per thread
+
+   // The farthest pair found in each chunk of nodes
+   unsigned (*chunkPair)[2];
+   unsigned* chunkDistance;
+
+   // Distances from the ends of the newest edge
+   const unsigned* viaA;
+   const unsigned* viaB;
+};
+
+#define FARTHESTGRAIN 32
+
+static void fillDistanceRows(void* context, unsigned begin, unsigned end, unsigned thread)
+{
+   struct FarthestPairs* pairs = context;
+   for (unsigned node = begin; node < end; ++node)
+   {
+      if (pairs->row[node] != UINT_MAX)
+         topologicalDistances(pairs->graph, &pairs->queue[(size_t)thread * pairs->nodeCount], node,
+                              &pairs->distance[(size_t)pairs->row[node] * pairs->nodeCount]);
+   }
+}
 
-      // If we're at target, we're done
-      if (node == b)
+// Finds the farthest pair starting in this chunk. Like a plain scan, the first
+// pair found at the largest distance wins, so merging the chunks in order
+// gives the same pair as scanning all of them at once.
+static void findFarthestInChunk(void* context, unsigned begin, unsigned end, unsigned thread)
+{
+   (void)thread;
+   struct FarthestPairs* pairs = context;
+   const struct MapGraph* graph = pairs->graph;
+   unsigned chunk = begin / FARTHESTGRAIN;
+   unsigned farthestNode[2] = {UINT_MAX, UINT_MAX};
+   unsigned farthestDistance = 0;
+   for (unsigned node = begin; node < end; ++node)
+   {
+      if (graph->degree[node] >= MAXCONNECTIONS)
+         continue;
+
+      const unsigned* fromNode = &pairs->distance[(size_t)pairs->row[node] * pairs->nodeCount];
+      for (unsigned candidate = 0; candidate < pairs->nodeCount; ++candidate)
       {
-         return depth;
+         if (fromNode[candidate] > farthestDistance &&
+             graph->degree[candidate] < MAXCONNECTIONS &&
+             node != candidate &&
+             !graphNodesConnect(graph, node, candidate))
+         {
+            farthestNode[0] = node;
+            farthestNode[1] = candidate;
+            farthestDistance = fromNode[candidate];
+         }
       }
-      
-      // Put all not already visited connections in the queue
-      getConnectedNodes(state, node, connected, &connectedCount);
-      for (unsigned i = 0; i < connectedCount; ++i)
+   }
+   pairs->chunkPair[chunk][0] = farthestNode[0];
+   pairs->chunkPair[chunk][1] = farthestNode[1];
+   pairs->chunkDistance[chunk] = farthestDistance;
+}
+
+// Shortens the rows of this chunk to go through the newest edge, where that is shorter
+static void updateRowsThroughEdge(void* context, unsigned begin, unsigned end, unsigned thread)
+{
+   (void)thread;
+   struct FarthestPairs* pairs = context;
+   const unsigned* viaA = pairs->viaA;
+   const unsigned* viaB = pairs->viaB;
+   for (unsigned node = begin; node < end; ++node)
+   {
+      if (pairs->row[node] == UINT_MAX || viaA[node] == UINT_MAX || viaB[node] == UINT_MAX)
+         continue;
+
+      unsigned* fromNode = &pairs->distance[(size_t)pairs->row[node] * pairs->nodeCount];
+      for (unsigned other = 0; other < pairs->nodeCount; ++other)
       {
-         if (visited[connected[i]])
-	    continue;
-         visited[connected[i]] = 1;
-	 
-         queue[head] = connected[i];
-         if (++head == state->nodeCount) head = 0;
+         if (viaB[other] != UINT_MAX && viaA[node] + 1 + viaB[other] < fromNode[other])
+            fromNode[other] = viaA[node] + 1 + viaB[other];
+         if (viaA[other] != UINT_MAX && viaB[node] + 1 + viaA[other] < fromNode[other])
+            fromNode[other] = viaB[node] + 1 + viaA[other];
       }
+   }
+}
 
-      if (--remainingAtDepth == 0)
+// Find pairs of nodes that are extremely far apart (in topology) and connect
+// them. This should balance the problem of "chain/highway galaxies".
+static void connectFarthestPairs(struct GameState* state, struct MapGraph* graph, unsigned pairCount)
+{
+   struct Scratch* scratch = &state->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned nodeCount = state->nodeCount;
+
+   // Only nodes with room for another connection can be part of a pair, and
+   // connecting pairs never makes room, so those are the only ones we need
+   // distances from. One row of the table (one BFS) for each of them.
+   struct FarthestPairs pairs = {0};
+   pairs.graph = graph;
+   pairs.nodeCount = nodeCount;
+   unsigned* row = scratchAlloc(scratch, sizeof(row[0]) * nodeCount);
+   unsigned rowCount = 0;
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      row[node] = graph->degree[node] < MAXCONNECTIONS ? rowCount++ : UINT_MAX;
+   }
+   pairs.row = row;
+   pairs.distance = scratchAlloc(scratch, sizeof(pairs.distance[0]) * rowCount * nodeCount);
+   pairs.queue = scratchAlloc(scratch, sizeof(pairs.queue[0]) * parallelThreadCount() * nodeCount);
+   parallelFor(nodeCount, FARTHESTGRAIN, fillDistanceRows, &pairs);
+
+   unsigned chunkCount = parallelChunkCount(nodeCount, FARTHESTGRAIN);
+   pairs.chunkPair = scratchAlloc(scratch, sizeof(pairs.chunkPair[0]) * chunkCount);
+   pairs.chunkDistance = scratchAlloc(scratch, sizeof(pairs.chunkDistance[0]) * chunkCount);
+   unsigned* viaA = scratchAlloc(scratch, sizeof(viaA[0]) * nodeCount);
+   unsigned* viaB = scratchAlloc(scratch, sizeof(viaB[0]) * nodeCount);
+   pairs.viaA = viaA;
+   pairs.viaB = viaB;
+   for (unsigned pair = 0; pair < pairCount; ++pair)
+   {
+      parallelFor(nodeCount, FARTHESTGRAIN, findFarthestInChunk, &pairs);
+      unsigned farthestNode[2] = {UINT_MAX, UINT_MAX};
+      unsigned farthestDistance = 0;
+      for (unsigned chunk = 0; chunk < chunkCount; ++chunk)
       {
-         ++depth;
-         if (head > tail)
-	    remainingAtDepth = head - tail;
-         else
-	    remainingAtDepth = head + state->nodeCount - tail;
+         if (pairs.chunkDistance[chunk] > farthestDistance)
+         {
+            farthestNode[0] = pairs.chunkPair[chunk][0];
+            farthestNode[1] = pairs.chunkPair[chunk][1];
+            farthestDistance = pairs.chunkDistance[chunk];
+         }
       }
+      if (farthestNode[0] == UINT_MAX || farthestNode[1] == UINT_MAX)
+         break;
+
+      unsigned a = farthestNode[0], b = farthestNode[1];
+      connectNodes(graph, a, b);
+      if (pair + 1 == pairCount)
+         break;
+
+      // Rather than searching again, the only new shortest paths are those
+      // through the new edge. Both its ends have rows, as they had room for it.
+      memcpy(viaA, &pairs.distance[(size_t)row[a] * nodeCount], sizeof(viaA[0]) * nodeCount);
+      memcpy(viaB, &pairs.distance[(size_t)row[b] * nodeCount], sizeof(viaB[0]) * nodeCount);
+      parallelFor(nodeCount, FARTHESTGRAIN, updateRowsThroughEdge, &pairs);
    }
 
-   // Should never be reached, unless the graph is disjoint (which is not allowed)
-   return -1;
+   scratchRestore(scratch, position);
 }
 
-static unsigned distanceToClosestEnemy(struct GameState* state, unsigned a)
+// Fills 'distance' with the number of hops from each node to the closest
+// node controlled by a player (0 for the player nodes themselves), with one
+// BFS starting from all of the player nodes at once. Nodes that can't reach
+// any player are UINT_MAX away.
+static void distancesToPlayers(struct GameState* state, unsigned* distance)
 {
-   // Do BFS for shortest distance between a and enemies.
-   unsigned queue[state->nodeCount];
-   unsigned visited[state->nodeCount];
-   memset(visited, 0, sizeof(visited[0]) * state->nodeCount);
-   unsigned head = 0, tail = 0, depth = 0, remainingAtDepth = 1;
-   unsigned player = state->controlledByInitial[a];
+   struct Scratch* scratch = &state->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned* queue = scratchAlloc(scratch, sizeof(queue[0]) * state->nodeCount);
+   unsigned head = 0, tail = 0;
 
-   // For getConnected
-   unsigned connected[MAXCONNECTIONS];
-   unsigned connectedCount = 0;
-   
-   queue[head++] = a;
-   visited[a] = 1;
-   while (head != tail)
+   for (unsigned node = 0; node < state->nodeCount; ++node)
    {
-      // Get a node from queue
-      unsigned node = queue[tail];
-      if (++tail == state->nodeCount) tail = 0;
-
-      // If we've found an enemy, we're done
-      unsigned nodeOwner = state->controlledByInitial[node];
-      if (nodeOwner != UINT_MAX && nodeOwner != player)
-      {
-         return depth;
-      }
-      
-      // Put all not already visited connections in the queue
-      getConnectedNodes(state, node, connected, &connectedCount);
-      for (unsigned i = 0; i < connectedCount; ++i)
+      if (state->controlledByInitial[node] != UINT_MAX)
       {
-         if (visited[connected[i]])
-	    continue;
-         visited[connected[i]] = 1;
-	 
-         queue[head] = connected[i];
-         if (++head == state->nodeCount) head = 0;
+         distance[node] = 0;
+         queue[head++] = node;
       }
+      else
+         distance[node] = UINT_MAX;
+   }
 
-      if (--remainingAtDepth == 0)
+   // Every node is queued at most once, so the queue never wraps
+   while (tail != head)
+   {
+      unsigned node = queue[tail++];
+      for (unsigned i = state->adjacencyOffsets[node]; i < state->adjacencyOffsets[node+1]; ++i)
       {
-         ++depth;
-         if (head > tail)
-	    remainingAtDepth = head - tail;
-         else
-	    remainingAtDepth = head + state->nodeCount - tail;
+         unsigned connected = state->adjacencyList[i];
+         if (distance[connected] != UINT_MAX)
+            continue;
+         distance[connected] = distance[node] + 1;
+         queue[head++] = connected;
       }
    }
 
-   // Should never be reached, unless there are no enemies to be found
-   return -1;
+   scratchRestore(scratch, position);
 }
 
 static void repulsePlayers(struct GameState* state)
 {
+   struct ScratchPosition position = scratchSave(&state->scratch);
+   unsigned* distance = scratchAlloc(&state->scratch, sizeof(distance[0]) * state->nodeCount);
+
    for (unsigned iterations = 0; iterations < 10; ++iterations)
    {         
       for (unsigned node = 0; node < state->nodeCount; ++node)
@@ -305,6 +772,9 @@ static void repulsePlayers(struct GameState* state)
          unsigned player = state->controlledByInitial[node];
          if (player != UINT_MAX)
          {
+            // Any player counts as an enemy of a neutral node, this one included
+            distancesToPlayers(state, distance);
+
             unsigned longestDistance = 0;
             unsigned bestNode = UINT_MAX;
             for (unsigned otherNode = 0; otherNode < state->nodeCount; ++otherNode)
@@ -312,10 +782,9 @@ static void repulsePlayers(struct GameState* state)
                unsigned otherPlayer = state->controlledByInitial[otherNode];
                if (otherPlayer == UINT_MAX)
                {
-                  unsigned distance = distanceToClosestEnemy(state, otherNode);
-                  if (distance > longestDistance)
+                  if (distance[otherNode] > longestDistance)
                   {
-                     longestDistance = distance;
+                     longestDistance = distance[otherNode];
                      bestNode = otherNode;
                   }
                }
@@ -330,94 +799,259 @@ static void repulsePlayers(struct GameState* state)
          }
       }
    }
+
+   scratchRestore(&state->scratch, position);
 }
 
-void startGame(struct GameState* state)
+// Nodes further apart than this don't repulse each other during layout
+#define LAYOUTRANGE 0.6f
+// Layout is done once no node moves further than this in a pass
+#define LAYOUTSETTLED 0.001f
+
+// A spatial hash for the layout. The cells are as large as the repulsion
+// range, so everything within range of a node is in the 27 cells around it.
+// Positions only change between passes, so the hash is simply made again for
+// every pass: the nodes sorted by bucket, with their positions and cells
+// alongside, so that going through a bucket reads memory in order.
+struct LayoutEntry
+{
+   Vec3 position;
+   int cell[3];
+   unsigned node;
+};
+
+struct LayoutHash
+{
+   unsigned bucketCount;
+   unsigned* start; // the entries of bucket b are start[b] up to start[b+1]
+   struct LayoutEntry* entries;
+   unsigned* bucket;
+};
+
+static unsigned layoutBucket(const struct LayoutHash* hash, int x, int y, int z)
+{
+   return (((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u)) % hash->bucketCount;
+}
+
+static int layoutCell(float position)
+{
+   return (int)floorf(position / LAYOUTRANGE);
+}
+
+// Sorts the nodes into their buckets (in node order within each bucket)
+static void fillLayoutHash(struct LayoutHash* hash, const Vec4* positions, unsigned nodeCount)
+{
+   memset(hash->start, 0, (hash->bucketCount + 1) * sizeof(hash->start[0]));
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      hash->bucket[node] = layoutBucket(hash, layoutCell(positions[node].x), layoutCell(positions[node].y), layoutCell(positions[node].z));
+      ++hash->start[hash->bucket[node] + 1];
+   }
+   for (unsigned bucket = 0; bucket < hash->bucketCount; ++bucket)
+      hash->start[bucket + 1] += hash->start[bucket];
+
+   // Each bucket is filled from its start, which is moved back again afterwards
+   for (unsigned node = 0; node < nodeCount; ++node)
+   {
+      struct LayoutEntry* entry = &hash->entries[hash->start[hash->bucket[node]]++];
+      entry->position = V4toV3(positions[node]);
+      entry->cell[0] = layoutCell(positions[node].x);
+      entry->cell[1] = layoutCell(positions[node].y);
+      entry->cell[2] = layoutCell(positions[node].z);
+      entry->node = node;
+   }
+   for (unsigned bucket = hash->bucketCount; bucket > 0; --bucket)
+      hash->start[bucket] = hash->start[bucket - 1];
+   hash->start[0] = 0;
+}
+
+// What the threads of a layout pass share
+struct LayoutPass
+{
+   struct GameState* state;
+   const struct LayoutHash* hash;
+   const Vec4* positions; // where the nodes were when the pass began
+   Vec4* moved;           // where they end up
+};
+
+#define LAYOUTGRAIN 64
+
+static void layoutNodes(void* context, unsigned begin, unsigned end, unsigned thread)
+{
+   (void)thread;
+   struct LayoutPass* pass = context;
+   struct GameState* state = pass->state;
+   const struct LayoutHash* hash = pass->hash;
+   const Vec4* positions = pass->positions;
+
+   for (unsigned node = begin; node < end; ++node)
+   {
+      Vec3 v3Start = V4toV3(positions[node]);
+      Vec3 v3Node = v3Start;
+
+      for (unsigned i = state->adjacencyOffsets[node]; i < state->adjacencyOffsets[node+1]; ++i)
+      {
+         unsigned otherNode = state->adjacencyList[i];
+
+         Vec3 v3OtherNode = V4toV3(positions[otherNode]);
+         float distance = V3Length(V3Subt(v3OtherNode, v3Node));
+         // Atract
+         if (distance > 0.5)
+         {
+            Vec3 towardsOther = V3ScalarMult(0.2, V3Normalized(V3Subt(v3OtherNode, v3Node)));
+            v3Node = V3Add(v3Node, towardsOther);
+         }
+         // (Repulse if TOO close)
+         else if (distance < 0.3)
+         {
+            Vec3 towardsOther = V3ScalarMult(-0.3, V3Normalized(V3Subt(v3OtherNode, v3Node)));
+            v3Node = V3Add(v3Node, towardsOther);
+         }
+      }
+
+      int cx = layoutCell(v3Start.x), cy = layoutCell(v3Start.y), cz = layoutCell(v3Start.z);
+      for (int z = cz - 1; z <= cz + 1; ++z)
+         for (int y = cy - 1; y <= cy + 1; ++y)
+            for (int x = cx - 1; x <= cx + 1; ++x)
+            {
+               unsigned bucket = layoutBucket(hash, x, y, z);
+               for (unsigned i = hash->start[bucket]; i < hash->start[bucket+1]; ++i)
+               {
+                  // Cells may share a bucket, nodes are only looked at from their own cell
+                  const struct LayoutEntry* other = &hash->entries[i];
+                  if (other->cell[0] != x || other->cell[1] != y || other->cell[2] != z || other->node == node)
+                     continue;
+
+                  // Repulse (connected nodes were dealt with above)
+                  if (V3SqrDist(other->position, v3Node) < LAYOUTRANGE * LAYOUTRANGE &&
+                      !nodesConnect(state, node, other->node))
+                  {
+                     Vec3 towardsOther = V3ScalarMult(-0.3, V3Normalized(V3Subt(other->position, v3Node)));
+                     v3Node = V3Add(v3Node, towardsOther);
+                  }
+               }
+            }
+
+      pass->moved[node] = V3toV4(v3Node);
+   }
+}
+
+/*
+  Every pass, each node is pulled towards the nodes it connects to (or pushed
+  away if they are too close), and then pushed away from other nodes within
+  LAYOUTRANGE, one step per node. All nodes move at once, by where the others
+  were when the pass began, so the nodes can be spread over threads. Only the
+  nodes found in the cells around a node are looked at for pushing, rather
+  than every other node. Stops after 100 passes, or sooner if nothing moves
+  anymore.
+*/
+static void layoutGraph(struct GameState* state)
+{
+   struct Scratch* scratch = &state->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned nodeCount = state->nodeCount;
+
+   struct LayoutHash hash;
+   hash.bucketCount = 2 * nodeCount + 1;
+   hash.start = scratchAlloc(scratch, (hash.bucketCount + 1) * sizeof(hash.start[0]));
+   hash.entries = scratchAlloc(scratch, nodeCount * sizeof(hash.entries[0]));
+   hash.bucket = scratchAlloc(scratch, nodeCount * sizeof(hash.bucket[0]));
+
+   struct LayoutPass pass = {state, &hash, NULL, NULL};
+   Vec4* moved = scratchAlloc(scratch, nodeCount * sizeof(moved[0]));
+   for (unsigned iterations = 0; iterations < 100; ++iterations)
+   {
+      fillLayoutHash(&hash, state->nodeSpacePositions, nodeCount);
+      pass.positions = state->nodeSpacePositions;
+      pass.moved = moved;
+      parallelFor(nodeCount, LAYOUTGRAIN, layoutNodes, &pass);
+
+      float largestMove = 0.0f;
+      for (unsigned node = 0; node < nodeCount; ++node)
+      {
+         float move = V3Length(V3Subt(V4toV3(moved[node]), V4toV3(state->nodeSpacePositions[node])));
+         if (move > largestMove)
+            largestMove = move;
+      }
+      memcpy(state->nodeSpacePositions, moved, nodeCount * sizeof(moved[0]));
+
+      if (largestMove < LAYOUTSETTLED)
+         break;
+   }
+
+   scratchRestore(scratch, position);
+}
+
+struct ConnectionQuery
+{
+   const struct MapGraph* graph;
+   unsigned node;
+};
+
+static int acceptConnection(unsigned candidate, void* context)
+{
+   struct ConnectionQuery* query = context;
+   return query->graph->degree[candidate] < MAXCONNECTIONS &&
+      !graphNodesConnect(query->graph, query->node, candidate);
+}
+
+static void generateFlatMap(struct GameState* state)
 {
-   if (state->metaGameState != PREGAME)
-      return;
-   
    state->nodeCount = NODESPERPLAYER * state->playerCount;
-   state->metaGameState = INGAME;
-   state->adjacencyMatrix = calloc(sizeof(*(state->adjacencyMatrix)),
-                                   (state->nodeCount * state->nodeCount));
+   struct MapGraph graph = createMapGraph(state->nodeCount);
    state->controlledBy = calloc(sizeof(*(state->controlledBy)), state->nodeCount);
    state->controlledByInitial = calloc(sizeof(*(state->controlledByInitial)), state->nodeCount);
    state->nodeSpacePositions = calloc(sizeof(*(state->nodeSpacePositions)), state->nodeCount);
+   struct Random random = seedRandom(state->seed);
    
    // Random out the nodes
    for (unsigned node = 0; node < state->nodeCount; ++node)
    {
-      state->nodeSpacePositions[node].x = ((float) (rand() % 1000) - 500.0) / 500.0;
-      state->nodeSpacePositions[node].y = ((float) (rand() % 1000) - 500.0) / 500.0;
-      state->nodeSpacePositions[node].z = ((float) (rand() % 1000) - 500.0) / 500.0;
+      state->nodeSpacePositions[node].x = ((float) (nextRandom(&random) % 1000) - 500.0) / 500.0;
+      state->nodeSpacePositions[node].y = ((float) (nextRandom(&random) % 1000) - 500.0) / 500.0;
+      state->nodeSpacePositions[node].z = ((float) (nextRandom(&random) % 1000) - 500.0) / 500.0;
       state->nodeSpacePositions[node].w = 1.0;
 
       state->controlledByInitial[node] = -1;
    }
 
    // Randomly connect  nodes
+   struct SpatialGrid grid = createSpatialGrid(state->nodeSpacePositions, state->nodeCount);
    for (unsigned node = 0; node < state->nodeCount; ++node)
    {
-      unsigned connectionsWanted = (rand() % (MAXCONNECTIONS - MINCONNECTIONS + 1)) + MINCONNECTIONS;
+      unsigned connectionsWanted = (nextRandom(&random) % (MAXCONNECTIONS - MINCONNECTIONS + 1)) + MINCONNECTIONS;
+      struct ConnectionQuery query = {&graph, node};
       
-      while (getConnectedCount(state, node) < connectionsWanted)
+      while (graph.degree[node] < connectionsWanted)
       {
-         unsigned nearestNode = UINT_MAX;
-         float nearestDistance = 9999999.0;
-         for (unsigned candidate = 0; candidate < state->nodeCount; ++candidate)
-         {
-            float distance = sqrt(V3SqrDist(V4toV3(state->nodeSpacePositions[node]),
-                                            V4toV3(state->nodeSpacePositions[candidate])));
-	    
-            if (!nodesConnect(state, node, candidate) &&
-                distance < nearestDistance &&
-                node != candidate &&
-                getConnectedCount(state, candidate) < MAXCONNECTIONS)
-            {
-               nearestNode = candidate;
-               nearestDistance = distance;
-            }
-         }
+         float nearestDistance;
+         unsigned nearestNode = nearestInSpatialGrid(&grid, state->nodeSpacePositions, node,
+                                                     acceptConnection, &query, &nearestDistance);
 
          if (nearestNode != UINT_MAX)
-            connectNodes(state, node, nearestNode);
+         {
+            connectNodes(&graph, node, nearestNode);
+
+            // Full nodes are of no interest to anyone anymore
+            if (graph.degree[node] >= MAXCONNECTIONS)
+               removeFromSpatialGrid(&grid, node);
+            if (graph.degree[nearestNode] >= MAXCONNECTIONS)
+               removeFromSpatialGrid(&grid, nearestNode);
+         }
          else
             break; // It may not possible to connect this node any further, causing an infinite loop.
       }
    }
+   freeSpatialGrid(&grid);
 
    // Walk the walk, islands are not allowed
-   connectIslands(state);
+   connectIslands(state, &graph);
 
-   // Find pairs of nodes that are extremely far apart (in topology)
-   // and connect them. This should balance the problem of "chain/highway galaxies"
-   for (unsigned iterations = 0; iterations < 2; ++iterations)
-   {
-      unsigned farthestNode[2] = {UINT_MAX, UINT_MAX};
-      unsigned farthestDistance = 0;
-      for (unsigned node = 0; node < state->nodeCount; ++node)
-      {
-         if (getConnectedCount(state, node) >= MAXCONNECTIONS)
-            continue;
-         
-         for (unsigned candidate = 0; candidate < state->nodeCount; ++candidate)
-         {
-            unsigned distance = topologicalDistance(state, node, candidate);
-            if (!nodesConnect(state, node, candidate) &&
-                distance > farthestDistance &&
-                node != candidate &&
-                getConnectedCount(state, candidate) < MAXCONNECTIONS)
-            {
-               farthestNode[0] = node;
-               farthestNode[1] = candidate;
-               farthestDistance = distance;
-            }
-         }
-      }
-      if (farthestNode[0] != UINT_MAX && farthestNode[1] != UINT_MAX)
-         connectNodes(state, farthestNode[0], farthestNode[1]);
-   }
+   connectFarthestPairs(state, &graph, 2);
+
+   // The edges are final from here on
+   storeMapGraph(state, &graph);
+   freeMapGraph(&graph);
    
    // Random out player positions
    {
@@ -426,10 +1060,10 @@ void startGame(struct GameState* state)
       
       for (unsigned player = 0; player < state->playerCount; ++player)
       {
-         unsigned node = rand() % state->nodeCount;
+         unsigned node = nextRandom(&random) % state->nodeCount;
          while (state->controlledByInitial[node] != -1)
          {
-            node = rand() % state->nodeCount;
+            node = nextRandom(&random) % state->nodeCount;
          }
          state->controlledByInitial[node] = player;
       }
@@ -443,45 +1077,271 @@ void startGame(struct GameState* state)
    repulsePlayers(state);
    
    // Do some passes of atract/repulse to make the graph easier on the human eye
-   for (unsigned iterations = 0; iterations < 100; ++iterations)
+   layoutGraph(state);
+}
+
+
+/*
+  Large games are not generated as one graph, as most of what generation
+  does grows faster than the number of nodes. Instead the players are dealt
+  out over regions of about REGIONPLAYERS players, each of which is generated
+  (on its own seed, and in parallel) like a small game. The regions are then
+  placed on a grid, and every region is linked to the regions next to it.
+*/
+#define REGIONPLAYERS 16
+// Room left between the regions
+#define REGIONGAP 0.5f
+// Link ends are kept at least this many hops from the players of their region, where possible
+#define LINKSEPARATION 2
+
+static void generateRegions(void* context, unsigned begin, unsigned end, unsigned thread)
+{
+   (void)thread;
+   struct GameState* regions = context;
+   for (unsigned region = begin; region < end; ++region)
+      generateFlatMap(&regions[region]);
+}
+
+// A neighbour of 'node' that it can lose its edge to, without cutting either
+// of them off from the rest of the nodes 'begin' up to 'end' (its region).
+// The best connected such neighbour, or UINT_MAX if there is none.
+static unsigned spareNeighbour(const struct MapGraph* graph, struct Scratch* scratch, unsigned node, unsigned begin, unsigned end)
+{
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned* queue = scratchAlloc(scratch, (end - begin) * sizeof(queue[0]));
+   const unsigned* row = &graph->neighbours[node * MAPGRAPHSLOTS];
+
+   unsigned spare = UINT_MAX;
+   for (unsigned i = 0; i < graph->degree[node]; ++i)
    {
-      for (unsigned node = 0; node < state->nodeCount; ++node)
+      unsigned neighbour = row[i];
+      if (neighbour < begin || neighbour >= end || graph->degree[neighbour] <= MINCONNECTIONS ||
+          (spare != UINT_MAX && graph->degree[neighbour] <= graph->degree[spare]))
+         continue;
+
+      // Look for another way from the node to the neighbour, within the region
+      clearMarks(scratch, graph->nodeCount);
+      setMark(scratch, node);
+      unsigned head = 0, tail = 0;
+      for (unsigned j = 0; j < graph->degree[node]; ++j)
+      {
+         if (row[j] != neighbour && row[j] >= begin && row[j] < end)
+         {
+            setMark(scratch, row[j]);
+            queue[head++] = row[j];
+         }
+      }
+      while (tail != head && !isMarked(scratch, neighbour))
       {
-         for (unsigned otherNode = 0; otherNode < state->nodeCount; ++otherNode)
+         unsigned current = queue[tail++];
+         for (unsigned j = 0; j < graph->degree[current]; ++j)
          {
-            Vec3 v3Node = V4toV3(state->nodeSpacePositions[node]);
-            Vec3 v3OtherNode = V4toV3(state->nodeSpacePositions[otherNode]);
+            unsigned next = graph->neighbours[current * MAPGRAPHSLOTS + j];
+            if (next < begin || next >= end || isMarked(scratch, next))
+               continue;
+            setMark(scratch, next);
+            queue[head++] = next;
+         }
+      }
+      if (isMarked(scratch, neighbour))
+         spare = neighbour;
+   }
 
-            if (nodesConnect(state, node, otherNode))
-            {
-               // Atract
-               if (V3Length(V3Subt(v3OtherNode, v3Node)) > 0.5)
-               {
-                  Vec3 towardsOther = V3ScalarMult(0.2, V3Normalized(V3Subt(v3OtherNode, v3Node)));
-                  v3Node = V3Add(v3Node, towardsOther);
-               }
-               // (Repulse if TOO close)
-               else if (V3Length(V3Subt(v3OtherNode, v3Node)) < 0.3)
-               {
-                  Vec3 towardsOther = V3ScalarMult(-0.3, V3Normalized(V3Subt(v3OtherNode, v3Node)));
-                  v3Node = V3Add(v3Node, towardsOther);
-               }
-            }
-            else
-            {
-               // Repulse
-               if (V3Length(V3Subt(v3OtherNode, v3Node)) < 0.6)
-               {
-                  Vec3 towardsOther = V3ScalarMult(-0.3, V3Normalized(V3Subt(v3OtherNode, v3Node)));
-                  v3Node = V3Add(v3Node, towardsOther);
-               }
-            }
+   scratchRestore(scratch, position);
+   return spare;
+}
 
-            state->nodeSpacePositions[node] = V3toV4(v3Node);
-            state->nodeSpacePositions[otherNode] = V3toV4(v3OtherNode);
+// Links the nodes 'begin' up to 'end' (one region) with those 'otherBegin' up
+// to 'otherEnd' (another). The ends are kept as far (up to LINKSEPARATION)
+// from the players of their regions as they can be, preferably on nodes with
+// room for another edge, and then as close to each other as they can be. A
+// full node can still be an end, by losing one of its edges that are not the
+// only way across its region.
+static void linkRegions(struct GameState* state, struct MapGraph* graph, const unsigned* playerDistance,
+                        unsigned begin, unsigned end, unsigned otherBegin, unsigned otherEnd)
+{
+   struct Scratch* scratch = &state->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+
+   // The neighbour each node would lose its edge to (UINT_MAX for nodes with room)
+   unsigned* spare = scratchAlloc(scratch, (end - begin + otherEnd - otherBegin) * sizeof(spare[0]));
+   unsigned* otherSpare = &spare[end - begin];
+   for (unsigned a = begin; a < end; ++a)
+      spare[a - begin] = graph->degree[a] < MAXCONNECTIONS ? UINT_MAX : spareNeighbour(graph, scratch, a, begin, end);
+   for (unsigned b = otherBegin; b < otherEnd; ++b)
+      otherSpare[b - otherBegin] = graph->degree[b] < MAXCONNECTIONS ? UINT_MAX : spareNeighbour(graph, scratch, b, otherBegin, otherEnd);
+
+   unsigned bestA = UINT_MAX, bestB = UINT_MAX;
+   unsigned bestSeparation = 0, bestLosses = 0;
+   float bestDistance = 0.0f;
+   for (unsigned a = begin; a < end; ++a)
+   {
+      if (graph->degree[a] >= MAXCONNECTIONS && spare[a - begin] == UINT_MAX)
+         continue;
+      for (unsigned b = otherBegin; b < otherEnd; ++b)
+      {
+         if (graph->degree[b] >= MAXCONNECTIONS && otherSpare[b - otherBegin] == UINT_MAX)
+            continue;
+
+         unsigned separation = playerDistance[a] < playerDistance[b] ? playerDistance[a] : playerDistance[b];
+         if (separation > LINKSEPARATION)
+            separation = LINKSEPARATION;
+         unsigned losses = (graph->degree[a] >= MAXCONNECTIONS) + (graph->degree[b] >= MAXCONNECTIONS);
+         float distance = V3SqrDist(V4toV3(state->nodeSpacePositions[a]), V4toV3(state->nodeSpacePositions[b]));
+         if (bestA == UINT_MAX || separation > bestSeparation ||
+             (separation == bestSeparation && losses < bestLosses) ||
+             (separation == bestSeparation && losses == bestLosses && distance < bestDistance))
+         {
+            bestA = a;
+            bestB = b;
+            bestSeparation = separation;
+            bestLosses = losses;
+            bestDistance = distance;
          }
       }
    }
+
+   // Regions that can't be linked here are still joined, by connectIslands()
+   if (bestA != UINT_MAX)
+   {
+      if (graph->degree[bestA] >= MAXCONNECTIONS)
+         disconnectNodes(graph, bestA, spare[bestA - begin]);
+      if (graph->degree[bestB] >= MAXCONNECTIONS)
+         disconnectNodes(graph, bestB, otherSpare[bestB - otherBegin]);
+      connectNodes(graph, bestA, bestB);
+   }
+
+   scratchRestore(scratch, position);
+}
+
+static void generateRegionalMap(struct GameState* state)
+{
+   struct Scratch* scratch = &state->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+   struct Random random = seedRandom(state->seed);
+
+   // Shuffle the players, so that who ends up next to whom does not depend on
+   // who joined first
+   unsigned* players = scratchAlloc(scratch, state->playerCount * sizeof(players[0]));
+   for (unsigned player = 0; player < state->playerCount; ++player)
+      players[player] = player;
+   for (unsigned player = state->playerCount - 1; player > 0; --player)
+   {
+      unsigned other = nextRandom(&random) % (player + 1);
+      unsigned swap = players[player];
+      players[player] = players[other];
+      players[other] = swap;
+   }
+
+   // Regions as even as they get, the first few a player larger than the rest
+   unsigned regionCount = (state->playerCount + REGIONPLAYERS - 1) / REGIONPLAYERS;
+   struct GameState* regions = scratchAlloc(scratch, regionCount * sizeof(regions[0]));
+   unsigned* firstPlayer = scratchAlloc(scratch, (regionCount + 1) * sizeof(firstPlayer[0]));
+   unsigned* firstNode = scratchAlloc(scratch, (regionCount + 1) * sizeof(firstNode[0]));
+   firstPlayer[0] = 0;
+   firstNode[0] = 0;
+   for (unsigned region = 0; region < regionCount; ++region)
+   {
+      memset(&regions[region], 0, sizeof(regions[region]));
+      regions[region].playerCount = state->playerCount / regionCount + (region < state->playerCount % regionCount);
+      regions[region].seed = ((uint64_t)nextRandom(&random) << 32) | nextRandom(&random);
+      firstPlayer[region+1] = firstPlayer[region] + regions[region].playerCount;
+      firstNode[region+1] = firstNode[region] + NODESPERPLAYER * regions[region].playerCount;
+   }
+   parallelFor(regionCount, 1, generateRegions, regions);
+
+   // The regions go on a grid, centered on their cells, with room for the largest of them
+   Vec3* center = scratchAlloc(scratch, regionCount * sizeof(center[0]));
+   float radius = 0.0f;
+   for (unsigned region = 0; region < regionCount; ++region)
+   {
+      const struct GameState* map = &regions[region];
+      Vec3 sum = {0.0f, 0.0f, 0.0f};
+      for (unsigned node = 0; node < map->nodeCount; ++node)
+         sum = V3Add(sum, V4toV3(map->nodeSpacePositions[node]));
+      center[region] = V3ScalarMult(1.0f / map->nodeCount, sum);
+      for (unsigned node = 0; node < map->nodeCount; ++node)
+      {
+         float distance = sqrt(V3SqrDist(V4toV3(map->nodeSpacePositions[node]), center[region]));
+         if (distance > radius)
+            radius = distance;
+      }
+   }
+   float spacing = 2.0f * radius + REGIONGAP;
+   unsigned gridSize = 1;
+   while (gridSize * gridSize * gridSize < regionCount)
+      ++gridSize;
+
+   // Put the regions together, as one graph
+   state->nodeCount = firstNode[regionCount];
+   state->controlledBy = calloc(sizeof(*(state->controlledBy)), state->nodeCount);
+   state->controlledByInitial = calloc(sizeof(*(state->controlledByInitial)), state->nodeCount);
+   state->nodeSpacePositions = calloc(sizeof(*(state->nodeSpacePositions)), state->nodeCount);
+   struct MapGraph graph = createMapGraph(state->nodeCount);
+   unsigned* playerDistance = scratchAlloc(scratch, state->nodeCount * sizeof(playerDistance[0]));
+   for (unsigned region = 0; region < regionCount; ++region)
+   {
+      struct GameState* map = &regions[region];
+      float middle = 0.5f * (gridSize - 1);
+      Vec3 cell = {spacing * (region % gridSize - middle),
+                   spacing * (region / gridSize % gridSize - middle),
+                   spacing * (region / (gridSize * gridSize) - middle)};
+      Vec3 offset = V3Subt(cell, center[region]);
+      for (unsigned node = 0; node < map->nodeCount; ++node)
+      {
+         unsigned global = firstNode[region] + node;
+         state->nodeSpacePositions[global] = V3toV4(V3Add(V4toV3(map->nodeSpacePositions[node]), offset));
+         unsigned player = map->controlledByInitial[node];
+         state->controlledByInitial[global] = player == UINT_MAX ? UINT_MAX : players[firstPlayer[region] + player];
+         for (unsigned i = map->adjacencyOffsets[node]; i < map->adjacencyOffsets[node+1]; ++i)
+            connectNodes(&graph, global, firstNode[region] + map->adjacencyList[i]);
+      }
+      distancesToPlayers(map, &playerDistance[firstNode[region]]);
+   }
+
+   // Link every region to the ones next to it on the grid. The regions fill
+   // the grid from the first cell on, so every region (but the first) has a
+   // neighbour before it, and the links join all of them (connectIslands()
+   // is only there to make sure).
+   for (unsigned region = 0; region < regionCount; ++region)
+   {
+      unsigned x = region % gridSize, y = region / gridSize % gridSize;
+      unsigned next[3] = {x + 1 < gridSize ? region + 1 : UINT_MAX,
+                          y + 1 < gridSize ? region + gridSize : UINT_MAX,
+                          region + gridSize * gridSize};
+      for (unsigned i = 0; i < 3; ++i)
+      {
+         if (next[i] < regionCount)
+            linkRegions(state, &graph, playerDistance, firstNode[region], firstNode[region+1],
+                        firstNode[next[i]], firstNode[next[i]+1]);
+      }
+   }
+   connectIslands(state, &graph);
+
+   storeMapGraph(state, &graph);
+   freeMapGraph(&graph);
+   for (unsigned region = 0; region < regionCount; ++region)
+      freeGameState(&regions[region]);
+   scratchRestore(scratch, position);
+}
+
+void generateMap(struct GameState* state)
+{
+   if (state->playerCount > 2 * REGIONPLAYERS)
+      generateRegionalMap(state);
+   else
+      generateFlatMap(state);
+}
+
+void startGame(struct GameState* state)
+{
+   if (state->metaGameState != PREGAME)
+      return;
+
+   // The map may have been made in advance
+   if (!state->nodeCount)
+      generateMap(state);
+   state->metaGameState = INGAME;
    
    // Start the first turn
    state->turnCount = 1;
@@ -542,11 +1402,11 @@ static void addSurrenderOrder(struct GameState* game, unsigned surrender, unsign
    }
 }
 
-void addOrder(struct GameState* game, enum OrderType type, unsigned from, unsigned to, const char* playerSecret)
+int addOrder(struct GameState* game, enum OrderType type, unsigned from, unsigned to, const char* playerSecret)
 {
    // Check that the game is in the expected state for new orders
    if (game->metaGameState != INGAME)
-      return;
+      return 0;
 
    // Determine ID of player giving order
    unsigned playerId = UINT_MAX;
@@ -559,19 +1419,20 @@ void addOrder(struct GameState* game, enum OrderType type, unsigned from, unsign
    }
    if (playerId == UINT_MAX)
    {
-      return;
+      return 0;
    }
 
    if (type == SURRENDERORDER)
    {
       addSurrenderOrder(game, to, playerId);
-      return;
+      return 1;
    }
    
    // Check that the player actually owns the "from" system
-   if ( playerId != game->controlledBy[from] || (!nodesConnect(game, from, to) && from != to) )
+   if ( from >= game->nodeCount || to >= game->nodeCount ||
+        playerId != game->controlledBy[from] || (!nodesConnect(game, from, to) && from != to) )
    {
-      return;
+      return 0;
    }
        
    struct Turn* turn = &(game->turn[game->turnCount-1]);
@@ -607,7 +1468,7 @@ void addOrder(struct GameState* game, enum OrderType type, unsigned from, unsign
             --i;
          }
       }
-      return;
+      return 1;
    }
 
    // resize orders arrays
@@ -626,21 +1487,32 @@ void addOrder(struct GameState* game, enum OrderType type, unsigned from, unsign
    turn->toNode[turn->orderCount] = to;
    turn->type[turn->orderCount] = type;
    turn->orderCount++;
+   return 1;
 }
 
 void freeGameState(struct GameState* state)
 {
-   if (state->adjacencyMatrix)
-      free(state->adjacencyMatrix);
+   if (state->mapping)
+   {
+      unmapGameFile(state);
+      return;
+   }
+   if (state->adjacencyOffsets)
+      free(state->adjacencyOffsets);
+   if (state->adjacencyList)
+      free(state->adjacencyList);
    if (state->controlledBy)
       free(state->controlledBy);
    if (state->controlledByInitial)
       free(state->controlledByInitial);
+   if (state->checkpoints)
+      free(state->checkpoints);
    if (state->nodeSpacePositions)
       free(state->nodeSpacePositions);
+   freeScratch(&state->scratch);
    if (state->gameName)
       free(state->gameName);
-   for (unsigned i = 0; i < state->playerCount; ++i)
+   for (unsigned i = 0; state->playerName && i < state->playerCount; ++i)
    {
       free(state->playerName[i]);
       free(state->playerColor[i]);
@@ -658,50 +1530,49 @@ void freeGameState(struct GameState* state)
 unsigned nodesConnect(struct GameState* state, unsigned a, unsigned b)
 {
    /*
-     Assuming 4 nodes, 0..3:
+     Assuming 4 nodes, 0..3, where 0 connects to 2 and 1 connects to 3:
 
-     the matrix might look something like:
+     adjacencyOffsets: 0, 1, 2, 3, 4
+     adjacencyList:    2, 3, 0, 1
 
-     0  1  2  3
-     ----------
-     0 |0, 0, 1, 0
-     1 |0, 0, 0, 1
-     2 |1, 0, 0, 0
-     3 |0, 1, 0, 0
+     There are never more than MAXCONNECTIONS to look through.
    */
 
-   return state->adjacencyMatrix[a * state->nodeCount + b];
+   for (unsigned i = state->adjacencyOffsets[a]; i < state->adjacencyOffsets[a+1]; ++i)
+   {
+      if (state->adjacencyList[i] == b)
+         return 1;
+   }
+   return 0;
+}
+
+unsigned countIslands(struct GameState* state)
+{
+   struct ScratchPosition position = scratchSave(&state->scratch);
+   struct IslandSet islands = createIslandSet(&state->scratch, state->nodeCount);
+   for (unsigned node = 0; node < state->nodeCount; ++node)
+   {
+      for (unsigned i = state->adjacencyOffsets[node]; i < state->adjacencyOffsets[node+1]; ++i)
+         joinIslands(&islands, node, state->adjacencyList[i]);
+   }
+   scratchRestore(&state->scratch, position);
+   return islands.count;
 }
 
 /*
   Fills the 'out' array with all nodes connected to 'a'.
-  'out' should be nodeCount in size.
+  'out' should be able to hold getConnectedCount(a) nodes, nodeCount is always enough.
   'outSize' tells the caller how many nodes are actually in the 'out' list
 */
 void getConnectedNodes(struct GameState* state, unsigned a, unsigned* out, unsigned* outSize)
 {
-   unsigned* nodeRow = & (state->adjacencyMatrix[a * state->nodeCount]);
-   
-   *outSize = 0;
-   for (unsigned i = 0; i < state->nodeCount; ++i)
-   {
-      if (nodeRow[i])
-      {
-         out[(*outSize)++] = i;
-      }
-   }
+   *outSize = getConnectedCount(state, a);
+   memcpy(out, &state->adjacencyList[state->adjacencyOffsets[a]], *outSize * sizeof(out[0]));
 }
 
 unsigned getConnectedCount(struct GameState* state, unsigned a)
 {
-   unsigned* nodeRow = & (state->adjacencyMatrix[a * state->nodeCount]);
-   unsigned count = 0;
-   for (unsigned i = 0; i < state->nodeCount; ++i)
-   {
-      if (nodeRow[i])
-         ++count;
-   }
-   return count;
+   return state->adjacencyOffsets[a+1] - state->adjacencyOffsets[a];
 }
 
 /*
@@ -713,31 +1584,25 @@ unsigned getConnectedCount(struct GameState* state, unsigned a)
 
   Deserialization must be unaffected by this.
 */
-void serialize(struct GameState* state, unsigned forPlayer, FILE* f)
+// The map part of a game file
+static void writeMap(struct GameState* state, FILE* f)
 {
-   fprintf(f, "%s\n", state->id);
-   fprintf(f, "%s\n", state->gameName);
-   fprintf(f, "%d\n", state->metaGameState);
-   fprintf(f, "%u\n", state->winningPlayer);
-   fprintf(f, "%u\n", state->playerCount);
-   for (unsigned i = 0; i < state->playerCount; ++i)
-   {
-      fprintf(f, "%s\n", state->playerName[i]);
-      fprintf(f, "%s\n", state->playerColor[i]);
-      if (forPlayer == -1 || forPlayer == i)
-         fprintf(f, "%s\n", state->playerSecret[i]);
-      else
-         fprintf(f, "REDACT\n");
-   }
-   
    fprintf(f, "%u\n", state->nodeCount);
+   // Edges are written as rows of an adjacency matrix (one digit per node)
    for (unsigned i = 0; i < state->nodeCount; ++i)
    {
+      unsigned edge = state->adjacencyOffsets[i];
       for (unsigned j = 0; j < state->nodeCount; ++j)
       {
-         fprintf(f, "%u", state->adjacencyMatrix[i*(state->nodeCount)+j]);
+         if (edge < state->adjacencyOffsets[i+1] && state->adjacencyList[edge] == j)
+         {
+            fputc('1', f);
+            ++edge;
+         }
+         else
+            fputc('0', f);
       }
-      fprintf(f, "\n");
+      fputc('\n', f);
    }
    for (unsigned i = 0; i < state->nodeCount; ++i)
    {
@@ -751,6 +1616,73 @@ void serialize(struct GameState* state, unsigned forPlayer, FILE* f)
    {
       fprintf(f, "%u\n", state->controlledByInitial[i]);
    }
+}
+
+static void readMap(struct GameState* state, FILE* f)
+{
+   fscanf(f, "%u\n", &state->nodeCount);
+   
+   state->controlledBy = calloc(sizeof(*(state->controlledBy)), state->nodeCount);
+   state->controlledByInitial = calloc(sizeof(*(state->controlledByInitial)), state->nodeCount);
+   state->nodeSpacePositions = calloc(sizeof(*(state->nodeSpacePositions)), state->nodeCount);
+   
+   // Collect the set digits of each adjacency matrix row into compressed rows
+   unsigned edgeCapacity = state->nodeCount * MAXCONNECTIONS;
+   state->adjacencyOffsets = malloc(sizeof(state->adjacencyOffsets[0]) * (state->nodeCount + 1));
+   state->adjacencyList = malloc(sizeof(state->adjacencyList[0]) * edgeCapacity);
+   state->adjacencyOffsets[0] = 0;
+   for (unsigned i = 0; i < state->nodeCount; ++i)
+   {
+      unsigned edgeCount = state->adjacencyOffsets[i];
+      for (unsigned j = 0; j < state->nodeCount; ++j)
+      {
+         if (fgetc(f) != '1')
+            continue;
+         if (edgeCount == edgeCapacity)
+         {
+            edgeCapacity *= 2;
+            state->adjacencyList = realloc(state->adjacencyList, sizeof(state->adjacencyList[0]) * edgeCapacity);
+         }
+         state->adjacencyList[edgeCount++] = j;
+      }
+      fscanf(f, "\n");
+      state->adjacencyOffsets[i+1] = edgeCount;
+   }
+
+   for (unsigned i = 0; i < state->nodeCount; ++i)
+   {
+      fscanf(f, "%f,%f,%f\n",
+             &state->nodeSpacePositions[i].x,
+             &state->nodeSpacePositions[i].y,
+             &state->nodeSpacePositions[i].z
+         );
+      state->nodeSpacePositions[i].w = 1.0;
+   }
+
+   for (unsigned i = 0; i < state->nodeCount; ++i)
+   {
+      fscanf(f, "%u\n", &state->controlledByInitial[i]);
+   }
+}
+
+void serialize(struct GameState* state, unsigned forPlayer, FILE* f)
+{
+   fprintf(f, "%s\n", state->id);
+   fprintf(f, "%s\n", state->gameName);
+   fprintf(f, "%d\n", state->metaGameState);
+   fprintf(f, "%u\n", state->winningPlayer);
+   fprintf(f, "%u\n", state->playerCount);
+   for (unsigned i = 0; i < state->playerCount; ++i)
+   {
+      fprintf(f, "%s\n", state->playerName[i]);
+      fprintf(f, "%s\n", state->playerColor[i]);
+      if (forPlayer == -1 || forPlayer == i)
+         fprintf(f, "%s\n", state->playerSecret[i]);
+      else
+         fprintf(f, "REDACT\n");
+   }
+   
+   writeMap(state, f);
    
    fprintf(f, "%u\n", state->turnCount);
 
@@ -823,11 +1755,14 @@ void serialize(struct GameState* state, unsigned forPlayer, FILE* f)
       }
    }
 
+   // Checkpoints are left out (the game file keeps them). Whoever reads this
+   // makes them again as they step through the history.
+   fprintf(f, "%llu\n", (unsigned long long)state->seed);
 }
 
 struct GameState deserialize(FILE* f)
 {
-   struct GameState state;
+   struct GameState state = {0};
       
    fscanf(f, "%6[^\n]\n", state.id);
    state.gameName = malloc(64);
@@ -848,36 +1783,7 @@ struct GameState deserialize(FILE* f)
       fscanf(f, "%6[^\n]\n", state.playerSecret[i]);
    }
 
-   fscanf(f, "%u\n", &state.nodeCount);
-   
-   state.adjacencyMatrix = calloc(sizeof(*(state.adjacencyMatrix)), (state.nodeCount * state.nodeCount));
-   state.controlledBy = calloc(sizeof(*(state.controlledBy)), state.nodeCount);
-   state.controlledByInitial = calloc(sizeof(*(state.controlledByInitial)), state.nodeCount);
-   state.nodeSpacePositions = calloc(sizeof(*(state.nodeSpacePositions)), state.nodeCount);
-   
-   for (unsigned i = 0; i < state.nodeCount; ++i)
-   {
-      for (unsigned j = 0; j < state.nodeCount; ++j)
-      {
-         fscanf(f, "%1u", &state.adjacencyMatrix[i*(state.nodeCount)+j]);
-      }
-      fscanf(f, "\n");
-   }
-
-   for (unsigned i = 0; i < state.nodeCount; ++i)
-   {
-      fscanf(f, "%f,%f,%f\n",
-             &state.nodeSpacePositions[i].x,
-             &state.nodeSpacePositions[i].y,
-             &state.nodeSpacePositions[i].z
-         );
-      state.nodeSpacePositions[i].w = 1.0;
-   }
-
-   for (unsigned i = 0; i < state.nodeCount; ++i)
-   {
-      fscanf(f, "%u\n", &state.controlledByInitial[i]);
-   }
+   readMap(&state, f);
    
    fscanf(f, "%u\n", &state.turnCount);
    state.turn = calloc(state.turnCount, sizeof(state.turn[0]));
@@ -899,6 +1805,33 @@ struct GameState deserialize(FILE* f)
       }
       
    }
+
+   // Games saved before they had seeds (their maps came from rand()) end here
+   unsigned long long seed;
+   if (fscanf(f, "%llu\n", &seed) == 1)
+      state.seed = seed;
    
    return state;
 }
+
+void serializeMap(struct GameState* state, FILE* f)
+{
+   fprintf(f, "%llu\n", (unsigned long long)state->seed);
+   fprintf(f, "%u\n", state->playerCount);
+   writeMap(state, f);
+}
+
+int deserializeMap(struct GameState* state, FILE* f)
+{
+   unsigned long long seed;
+   unsigned playerCount;
+   if (state->nodeCount ||
+       fscanf(f, "%llu\n", &seed) != 1 ||
+       fscanf(f, "%u\n", &playerCount) != 1 ||
+       playerCount != state->playerCount)
+      return 0;
+
+   state->seed = seed;
+   readMap(state, f);
+   return 1;
+}
@@ -2,8 +2,10 @@
 #define GAME_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include "../common/math/vec.h"
+#include "scratch.h"
 
 enum MetaGameState
 {
@@ -34,16 +36,30 @@ struct GameState
    // The number of playable "spaces/systems" in the game
    unsigned nodeCount;
 
-   // Edges of the graph
-   unsigned* adjacencyMatrix;
+   // Edges of the graph, in compressed sparse row form. The nodes connected to
+   // node n are adjacencyList[adjacencyOffsets[n]] up to (but not including)
+   // adjacencyList[adjacencyOffsets[n+1]], in ascending order.
+   unsigned* adjacencyOffsets;
+   unsigned* adjacencyList;
 
    // ID of player controlling each node
    unsigned* controlledBy; // not serialized, derived from turn data
    unsigned* controlledByInitial;
 
+   // Snapshots of controlledBy, as it looked after every checkpointInterval
+   // resolved turns. Derived from turn data, but serialized anyway, so that
+   // old games need not be replayed all the way from the first turn.
+   unsigned checkpointInterval;
+   unsigned checkpointCount;
+   unsigned* checkpoints;
+
    // 3d positions of the nodes in the graph
    Vec4* nodeSpacePositions;
 
+   // Everything random about the map (and the colors players get, when theirs
+   // are taken) comes from this seed, so the map can be generated again.
+   uint64_t seed;
+
    // The ID of the game session
    char id[7];
 
@@ -66,17 +82,39 @@ struct GameState
    unsigned turnCount;
 
    struct Turn* turn;
+
+   // How many times the game file has been written out, which tells the
+   // journal of orders given since (see gamefile.h) from a stale one. Not
+   // serialized.
+   unsigned journalSequence;
+
+   // Working memory for turn resolution and map generation. Not serialized.
+   struct Scratch scratch;
+
+   // The game file the arrays above point into, for a state that was mapped
+   // instead of read (see mapGameFile()), and which must then not be changed.
+   // Not serialized.
+   void* mapping;
+   size_t mappingSize;
 };
 
 // Functions for managing the game state
 
 struct GameState initatePreGame(const char* gameName);
 
+// Makes the map (nodes, edges and starting positions) for the players who
+// have joined, from the seed of the game
+void generateMap(struct GameState* state);
+
+// Generates the map, unless one was already given to the game, and begins the first turn
 void startGame(struct GameState* state);
 
 void addPlayer(struct GameState* game, const char* name, char* color, const char* playerSecret);
 
-void addOrder(struct GameState* game, enum OrderType type, unsigned from, unsigned to, const char* playerSecret);
+// Returns 0 if the order was turned down (the game not under way, or the
+// order not from one of its players, not from their node or not to a
+// neighbour of it), in which case nothing was changed
+int addOrder(struct GameState* game, enum OrderType type, unsigned from, unsigned to, const char* playerSecret);
 
 void freeGameState(struct GameState* state);
 
@@ -88,8 +126,18 @@ void getConnectedNodes(struct GameState* state, unsigned a, unsigned* out, unsig
 
 unsigned getConnectedCount(struct GameState* state, unsigned a);
 
+// How many separate islands the graph consists of (1 for every started game)
+unsigned countIslands(struct GameState* state);
+
 void serialize(struct GameState* state, unsigned forPlayer, FILE* f);
 
 struct GameState deserialize(FILE* f);
 
+// A map made in advance by generateMap(), with the seed and player count it
+// was made for. deserializeMap() hands it to a game that has no map yet, and
+// fails (returns 0) if the game has another number of players.
+void serializeMap(struct GameState* state, FILE* f);
+
+int deserializeMap(struct GameState* state, FILE* f);
+
 #endif
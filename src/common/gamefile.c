@@ -0,0 +1,724 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gamefile.h"
+#include "turnresolution.h"
+
+// The whole file is put together (or taken apart) in memory, and written (or
+// read) with a single call
+
+struct Writer
+{
+   unsigned char* data;
+   size_t size;
+   size_t capacity;
+};
+
+static void writeBytes(struct Writer* writer, const void* bytes, size_t count)
+{
+   if (writer->size + count > writer->capacity)
+   {
+      writer->capacity = 2 * (writer->size + count);
+      writer->data = realloc(writer->data, writer->capacity);
+   }
+   memcpy(writer->data + writer->size, bytes, count);
+   writer->size += count;
+}
+
+static void writeFixed(struct Writer* writer, uint64_t value, unsigned byteCount)
+{
+   unsigned char bytes[8];
+   for (unsigned i = 0; i < byteCount; ++i)
+      bytes[i] = (value >> (8 * i)) & 0xff;
+   writeBytes(writer, bytes, byteCount);
+}
+
+static void writeVarint(struct Writer* writer, uint64_t value)
+{
+   unsigned char bytes[10];
+   unsigned count = 0;
+   do
+   {
+      bytes[count] = value & 0x7f;
+      value >>= 7;
+      if (value)
+         bytes[count] |= 0x80;
+      ++count;
+   } while (value);
+   writeBytes(writer, bytes, count);
+}
+
+// For node and player numbers, where UINT_MAX means none
+static void writeIndex(struct Writer* writer, unsigned index)
+{
+   writeVarint(writer, index == UINT_MAX ? 0 : (uint64_t)index + 1);
+}
+
+struct Reader
+{
+   const unsigned char* at;
+   const unsigned char* end;
+   int failed; // set once anything was read past the end, or was out of range
+};
+
+static int readBytes(struct Reader* reader, void* bytes, size_t count)
+{
+   if (reader->failed || (size_t)(reader->end - reader->at) < count)
+   {
+      reader->failed = 1;
+      memset(bytes, 0, count);
+      return 0;
+   }
+   memcpy(bytes, reader->at, count);
+   reader->at += count;
+   return 1;
+}
+
+static uint64_t readVarint(struct Reader* reader)
+{
+   uint64_t value = 0;
+   for (unsigned shift = 0; shift < 64; shift += 7)
+   {
+      unsigned char byte;
+      if (!readBytes(reader, &byte, 1))
+         return 0;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+         return value;
+   }
+   reader->failed = 1;
+   return 0;
+}
+
+static unsigned readUnsigned(struct Reader* reader)
+{
+   uint64_t value = readVarint(reader);
+   if (value > UINT_MAX)
+   {
+      reader->failed = 1;
+      return 0;
+   }
+   return value;
+}
+
+static unsigned readIndex(struct Reader* reader)
+{
+   uint64_t value = readVarint(reader);
+   if (value > (uint64_t)UINT_MAX)
+   {
+      reader->failed = 1;
+      return 0;
+   }
+   return value == 0 ? UINT_MAX : (unsigned)(value - 1);
+}
+
+// A count of things, each taking at least 'minimumSize' bytes. Checked against
+// what is left of the file, so that a broken count can't make us allocate
+// more than the file could ever hold.
+static unsigned readCount(struct Reader* reader, size_t minimumSize)
+{
+   unsigned count = readUnsigned(reader);
+   if ((uint64_t)count * minimumSize > (uint64_t)(reader->end - reader->at))
+   {
+      reader->failed = 1;
+      return 0;
+   }
+   return count;
+}
+
+static uint64_t readFixed(struct Reader* reader, unsigned byteCount)
+{
+   unsigned char bytes[8];
+   uint64_t value = 0;
+   readBytes(reader, bytes, byteCount);
+   for (unsigned i = 0; i < byteCount; ++i)
+      value |= (uint64_t)bytes[i] << (8 * i);
+   return value;
+}
+
+/*
+  The file is laid out so that it can be used where it lies: a fixed header,
+  strings in fixed slots, then every array aligned to 16 bytes and in the very
+  form GameState holds it. Only the history at the end is coded, as by
+  writeHistory(), which is a fraction of the size and is decoded straight
+  into the turns.
+*/
+
+#define ARRAYALIGNMENT 16
+#define IDSLOT 8
+#define NAMESLOT 64
+#define COLORSLOT 8
+#define SECRETSLOT 8
+
+static int littleEndianHost()
+{
+   const uint16_t one = 1;
+   return *(const unsigned char*)&one == 1;
+}
+
+static void writeAlignment(struct Writer* writer)
+{
+   static const unsigned char zeros[ARRAYALIGNMENT] = {0};
+   writeBytes(writer, zeros, (ARRAYALIGNMENT - writer->size % ARRAYALIGNMENT) % ARRAYALIGNMENT);
+}
+
+// A string in 'width' bytes, cut short if need be so that it always ends in 0
+static void writeSlot(struct Writer* writer, const char* string, size_t width)
+{
+   char slot[NAMESLOT] = {0};
+   size_t length = strlen(string);
+   memcpy(slot, string, length < width - 1 ? length : width - 1);
+   writeBytes(writer, slot, width);
+}
+
+// 'count' 32 bit words, unsigned or float
+static void writeWords(struct Writer* writer, const void* words, size_t count)
+{
+   if (!count)
+      return;
+   if (littleEndianHost())
+   {
+      writeBytes(writer, words, 4 * count);
+      return;
+   }
+   for (size_t i = 0; i < count; ++i)
+   {
+      uint32_t word;
+      memcpy(&word, (const unsigned char*)words + 4 * i, 4);
+      writeFixed(writer, word, 4);
+   }
+}
+
+// Which of the neighbours of 'from' 'to' is, counting from 1, or 0 if it
+// isn't one
+static unsigned neighbourNumber(const struct GameState* state, unsigned from, unsigned to)
+{
+   if (from >= state->nodeCount)
+      return 0;
+   for (unsigned i = state->adjacencyOffsets[from]; i < state->adjacencyOffsets[from+1]; ++i)
+   {
+      if (state->adjacencyList[i] == to)
+         return i - state->adjacencyOffsets[from] + 1;
+   }
+   return 0;
+}
+
+/*
+  The history, turn by turn: the order count, then the orders in runs given by
+  the same player, each run being the player and its length. An order is the
+  number of the to node among the neighbours of the from node (0 if it isn't
+  one of them) shifted left by 2 with the type in the 2 bits below it (3 if
+  it doesn't fit, with the type itself following), then how far the from node
+  is from that of the order before it, zigzag coded, and then the to node if
+  it wasn't a neighbour. Everything is a varint, so an order to a neighbour
+  takes 2 to 4 bytes rather than 16.
+*/
+static void writeHistory(struct Writer* writer, const struct GameState* state)
+{
+   for (unsigned i = 0; i < state->turnCount; ++i)
+   {
+      const struct Turn* turn = &state->turn[i];
+      writeVarint(writer, turn->orderCount);
+      uint64_t lastFrom = 0; // from nodes plus 1, so that none is 0
+      for (unsigned runStart = 0, runEnd; runStart < turn->orderCount; runStart = runEnd)
+      {
+         for (runEnd = runStart + 1; runEnd < turn->orderCount; ++runEnd)
+         {
+            if (turn->issuingPlayer[runEnd] != turn->issuingPlayer[runStart])
+               break;
+         }
+         writeIndex(writer, turn->issuingPlayer[runStart]);
+         writeVarint(writer, runEnd - runStart);
+
+         for (unsigned j = runStart; j < runEnd; ++j)
+         {
+            unsigned neighbour = neighbourNumber(state, turn->fromNode[j], turn->toNode[j]);
+            unsigned typeCode = turn->type[j] < 3 ? turn->type[j] : 3;
+            writeVarint(writer, (uint64_t)neighbour << 2 | typeCode);
+            if (typeCode == 3)
+               writeVarint(writer, turn->type[j]);
+
+            uint64_t from = turn->fromNode[j] == UINT_MAX ? 0 : (uint64_t)turn->fromNode[j] + 1;
+            int64_t step = (int64_t)(from - lastFrom);
+            writeVarint(writer, (uint64_t)step << 1 ^ (uint64_t)(step >> 63));
+            lastFrom = from;
+
+            if (!neighbour)
+               writeIndex(writer, turn->toNode[j]);
+         }
+      }
+   }
+}
+
+void writeGameFile(struct GameState* state, FILE* f)
+{
+   unsigned edgeEndCount = state->nodeCount ? state->adjacencyOffsets[state->nodeCount] : 0;
+   unsigned orderCount = 0;
+   for (unsigned i = 0; i < state->turnCount; ++i)
+      orderCount += state->turn[i].orderCount;
+
+   struct Writer writer = {0};
+   writeBytes(&writer, GAMEFILEMAGIC, 4);
+   writeFixed(&writer, GAMEFILEVERSION, 4);
+
+   writeFixed(&writer, state->metaGameState, 4);
+   writeFixed(&writer, state->winningPlayer, 4);
+   writeFixed(&writer, state->playerCount, 4);
+   writeFixed(&writer, state->nodeCount, 4);
+   writeFixed(&writer, edgeEndCount, 4);
+   writeFixed(&writer, state->turnCount, 4);
+   writeFixed(&writer, orderCount, 4);
+   writeFixed(&writer, state->checkpointInterval, 4);
+   writeFixed(&writer, state->checkpointCount, 4);
+   writeFixed(&writer, state->journalSequence, 4);
+   writeFixed(&writer, state->seed, 8);
+
+   writeSlot(&writer, state->id, IDSLOT);
+   writeSlot(&writer, state->gameName, NAMESLOT);
+   for (unsigned i = 0; i < state->playerCount; ++i)
+   {
+      writeSlot(&writer, state->playerName[i], NAMESLOT);
+      writeSlot(&writer, state->playerColor[i], COLORSLOT);
+      writeSlot(&writer, state->playerSecret[i], SECRETSLOT);
+   }
+
+   if (state->nodeCount)
+   {
+      writeAlignment(&writer);
+      writeWords(&writer, state->adjacencyOffsets, state->nodeCount + 1);
+   }
+   writeAlignment(&writer);
+   writeWords(&writer, state->adjacencyList, edgeEndCount);
+   writeAlignment(&writer);
+   writeWords(&writer, state->nodeSpacePositions, 4 * (size_t)state->nodeCount);
+   writeAlignment(&writer);
+   writeWords(&writer, state->controlledByInitial, state->nodeCount);
+
+   writeAlignment(&writer);
+   writeWords(&writer, state->checkpoints, (size_t)state->checkpointCount * state->nodeCount);
+
+   writeAlignment(&writer);
+   writeHistory(&writer, state);
+
+   fwrite(writer.data, 1, writer.size, f);
+   free(writer.data);
+}
+
+// A string slot of 'width' bytes, left where it is
+static char* takeSlot(struct Reader* reader, size_t width)
+{
+   if (reader->failed || (size_t)(reader->end - reader->at) < width || !memchr(reader->at, 0, width))
+   {
+      reader->failed = 1;
+      return NULL;
+   }
+   char* slot = (char*)reader->at;
+   reader->at += width;
+   return slot;
+}
+
+// Moves past the padding before the next array. 'base' is the start of the
+// file, which the alignment is counted from.
+static void skipAlignment(struct Reader* reader, const unsigned char* base)
+{
+   size_t padding = (ARRAYALIGNMENT - (reader->at - base) % ARRAYALIGNMENT) % ARRAYALIGNMENT;
+   if (reader->failed || padding > (size_t)(reader->end - reader->at))
+      reader->failed = 1;
+   else
+      reader->at += padding;
+}
+
+// 'count' elements of 'words' 32 bit words each, left where they are (after
+// being put in our byte order, if it isn't the file's)
+static void* takeArray(struct Reader* reader, const unsigned char* base, size_t count, size_t words)
+{
+   if (!count || !words)
+      return NULL;
+   skipAlignment(reader, base);
+   if (reader->failed || count > (size_t)(reader->end - reader->at) / (4 * words))
+   {
+      reader->failed = 1;
+      return NULL;
+   }
+   unsigned char* array = (unsigned char*)reader->at;
+   reader->at += 4 * words * count;
+   if (!littleEndianHost())
+   {
+      for (size_t i = 0; i < 4 * words * count; i += 4)
+      {
+         unsigned char swapped[4] = {array[i+3], array[i+2], array[i+1], array[i]};
+         memcpy(array + i, swapped, 4);
+      }
+   }
+   return array;
+}
+
+// Decodes the history written by writeHistory() into the turns of 'state',
+// whose turnCount has been read already. 'orderCount' is the number of
+// orders there should be in all.
+static void readHistory(struct Reader* reader, struct GameState* state, unsigned orderCount)
+{
+   // An order count at least for every turn
+   if (state->turnCount > (size_t)(reader->end - reader->at))
+      reader->failed = 1;
+   if (reader->failed)
+   {
+      state->turnCount = 0;
+      return;
+   }
+   state->turn = calloc(state->turnCount, sizeof(state->turn[0]));
+
+   uint64_t ordersRead = 0;
+   for (unsigned i = 0; i < state->turnCount && !reader->failed; ++i)
+   {
+      struct Turn* turn = &state->turn[i];
+      // Two bytes an order at the very least
+      turn->orderCount = readCount(reader, 2);
+      turn->issuingPlayer = malloc(turn->orderCount * sizeof(turn->issuingPlayer[0]));
+      turn->fromNode = malloc(turn->orderCount * sizeof(turn->fromNode[0]));
+      turn->toNode = malloc(turn->orderCount * sizeof(turn->toNode[0]));
+      turn->type = malloc(turn->orderCount * sizeof(turn->type[0]));
+      ordersRead += turn->orderCount;
+
+      uint64_t lastFrom = 0;
+      unsigned j = 0;
+      while (j < turn->orderCount && !reader->failed)
+      {
+         unsigned player = readIndex(reader);
+         unsigned runLength = readUnsigned(reader);
+         if (runLength == 0 || runLength > turn->orderCount - j)
+         {
+            reader->failed = 1;
+            break;
+         }
+         for (unsigned runEnd = j + runLength; j < runEnd; ++j)
+         {
+            uint64_t code = readVarint(reader);
+            uint64_t neighbour = code >> 2;
+            turn->issuingPlayer[j] = player;
+            turn->type[j] = (code & 3) == 3 ? readUnsigned(reader) : (unsigned)(code & 3);
+
+            uint64_t step = readVarint(reader);
+            uint64_t from = lastFrom + ((step >> 1) ^ -(step & 1));
+            if (from > UINT_MAX)
+               reader->failed = 1;
+            turn->fromNode[j] = from == 0 ? UINT_MAX : (unsigned)(from - 1);
+            lastFrom = from;
+
+            if (!neighbour)
+               turn->toNode[j] = readIndex(reader);
+            else if (turn->fromNode[j] < state->nodeCount &&
+                     neighbour <= getConnectedCount(state, turn->fromNode[j]))
+               turn->toNode[j] = state->adjacencyList[state->adjacencyOffsets[turn->fromNode[j]] + neighbour - 1];
+            else
+               reader->failed = 1;
+            if (reader->failed)
+               break;
+         }
+      }
+   }
+   if (ordersRead != orderCount)
+      reader->failed = 1;
+}
+
+// The parts of a layout that are not in the file itself (the turns being
+// decoded rather than laid out)
+static void freeLayout(struct GameState* state)
+{
+   free(state->playerName);
+   free(state->playerColor);
+   free(state->playerSecret);
+   for (unsigned i = 0; state->turn && i < state->turnCount; ++i)
+   {
+      free(state->turn[i].issuingPlayer);
+      free(state->turn[i].fromNode);
+      free(state->turn[i].toNode);
+      free(state->turn[i].type);
+   }
+   free(state->turn);
+}
+
+// Points 'state' into a game file (everything but controlledBy, and the
+// history, which is decoded), making sure that nothing in it points outside
+// of it. 'reader' starts right after the version.
+static int layoutFile(struct Reader* reader, const unsigned char* base, struct GameState* state)
+{
+   state->metaGameState = readFixed(reader, 4);
+   state->winningPlayer = readFixed(reader, 4);
+   state->playerCount = readFixed(reader, 4);
+   state->nodeCount = readFixed(reader, 4);
+   unsigned edgeEndCount = readFixed(reader, 4);
+   state->turnCount = readFixed(reader, 4);
+   unsigned orderCount = readFixed(reader, 4);
+   state->checkpointInterval = readFixed(reader, 4);
+   state->checkpointCount = readFixed(reader, 4);
+   state->journalSequence = readFixed(reader, 4);
+   state->seed = readFixed(reader, 8);
+
+   const char* id = takeSlot(reader, IDSLOT);
+   if (id && strlen(id) < sizeof(state->id))
+      strcpy(state->id, id);
+   else
+      reader->failed = 1;
+   state->gameName = takeSlot(reader, NAMESLOT);
+
+   const size_t playerSize = NAMESLOT + COLORSLOT + SECRETSLOT;
+   if (reader->failed || state->playerCount > (size_t)(reader->end - reader->at) / playerSize)
+   {
+      state->playerCount = 0;
+      state->turnCount = 0;
+      return 0;
+   }
+   state->playerName = malloc(state->playerCount * sizeof(state->playerName[0]));
+   state->playerColor = malloc(state->playerCount * sizeof(state->playerColor[0]));
+   state->playerSecret = malloc(state->playerCount * sizeof(state->playerSecret[0]));
+   for (unsigned i = 0; i < state->playerCount; ++i)
+   {
+      state->playerName[i] = takeSlot(reader, NAMESLOT);
+      state->playerColor[i] = takeSlot(reader, COLORSLOT);
+      state->playerSecret[i] = takeSlot(reader, SECRETSLOT);
+   }
+
+   state->adjacencyOffsets = takeArray(reader, base, state->nodeCount ? state->nodeCount + 1 : 0, 1);
+   state->adjacencyList = takeArray(reader, base, edgeEndCount, 1);
+   if (state->nodeCount && !reader->failed)
+   {
+      if (state->adjacencyOffsets[0] != 0 || state->adjacencyOffsets[state->nodeCount] != edgeEndCount)
+         reader->failed = 1;
+      for (unsigned node = 0; node < state->nodeCount && !reader->failed; ++node)
+      {
+         if (state->adjacencyOffsets[node] > state->adjacencyOffsets[node+1])
+            reader->failed = 1;
+      }
+      for (unsigned i = 0; i < edgeEndCount && !reader->failed; ++i)
+      {
+         if (state->adjacencyList[i] >= state->nodeCount)
+            reader->failed = 1;
+      }
+   }
+   else if (edgeEndCount)
+      reader->failed = 1;
+   state->nodeSpacePositions = takeArray(reader, base, state->nodeCount, 4);
+   state->controlledByInitial = takeArray(reader, base, state->nodeCount, 1);
+
+   state->checkpoints = takeArray(reader, base, state->checkpointCount, state->nodeCount);
+   skipAlignment(reader, base);
+   readHistory(reader, state, orderCount);
+   return !reader->failed;
+}
+
+static void* copyOf(const void* data, size_t size)
+{
+   if (!data)
+      return NULL;
+   void* copy = malloc(size);
+   memcpy(copy, data, size);
+   return copy;
+}
+
+// Gives a state laid out over a file copies of its own of everything in it
+// (but the turns, which are its own already)
+static void copyLayout(struct GameState* state)
+{
+   state->gameName = copyOf(state->gameName, NAMESLOT);
+   for (unsigned i = 0; i < state->playerCount; ++i)
+   {
+      state->playerName[i] = copyOf(state->playerName[i], NAMESLOT);
+      state->playerColor[i] = copyOf(state->playerColor[i], COLORSLOT);
+      state->playerSecret[i] = copyOf(state->playerSecret[i], SECRETSLOT);
+   }
+   unsigned edgeEndCount = state->nodeCount ? state->adjacencyOffsets[state->nodeCount] : 0;
+   state->adjacencyOffsets = copyOf(state->adjacencyOffsets, (state->nodeCount + 1) * sizeof(state->adjacencyOffsets[0]));
+   state->adjacencyList = copyOf(state->adjacencyList, edgeEndCount * sizeof(state->adjacencyList[0]));
+   state->nodeSpacePositions = copyOf(state->nodeSpacePositions, state->nodeCount * sizeof(state->nodeSpacePositions[0]));
+   state->controlledByInitial = copyOf(state->controlledByInitial, state->nodeCount * sizeof(state->controlledByInitial[0]));
+   state->checkpoints = copyOf(state->checkpoints, (size_t)state->checkpointCount * state->nodeCount * sizeof(state->checkpoints[0]));
+   state->controlledBy = calloc(state->nodeCount, sizeof(state->controlledBy[0]));
+}
+
+int readGameFile(FILE* f, struct GameState* state)
+{
+   // Take in the whole file
+   size_t size = 0, capacity = 1 << 16;
+   unsigned char* data = malloc(capacity);
+   size_t got;
+   while ((got = fread(data + size, 1, capacity - size, f)) > 0)
+   {
+      size += got;
+      if (size == capacity)
+      {
+         capacity *= 2;
+         data = realloc(data, capacity);
+      }
+   }
+
+   int read;
+   memset(state, 0, sizeof(*state));
+   if (size >= 4 && !memcmp(data, GAMEFILEMAGIC, 4))
+   {
+      struct Reader reader = {data + 4, data + size, 0};
+      read = readFixed(&reader, 4) == GAMEFILEVERSION && layoutFile(&reader, data, state);
+      if (read)
+         copyLayout(state);
+      else
+      {
+         freeLayout(state);
+         memset(state, 0, sizeof(*state));
+      }
+   }
+   else
+   {
+      // The text form, as written by serialize()
+      rewind(f);
+      *state = deserialize(f);
+      read = 1;
+   }
+
+   free(data);
+   return read;
+}
+
+int mapGameFile(const char* path, struct GameState* state)
+{
+   memset(state, 0, sizeof(*state));
+   int fd = open(path, O_RDONLY);
+   if (fd == -1)
+      return 0;
+
+   struct stat st;
+   unsigned char* data = MAP_FAILED;
+   size_t size = 0;
+   if (!fstat(fd, &st) && st.st_size >= 8)
+   {
+      size = st.st_size;
+      // Swapping the byte order means writing to our own copy of the pages
+      data = mmap(NULL, size, PROT_READ | (littleEndianHost() ? 0 : PROT_WRITE), MAP_PRIVATE, fd, 0);
+   }
+   if (data != MAP_FAILED && !memcmp(data, GAMEFILEMAGIC, 4))
+   {
+      struct Reader reader = {data + 4, data + size, 0};
+      if (readFixed(&reader, 4) == GAMEFILEVERSION)
+      {
+         close(fd);
+         if (!layoutFile(&reader, data, state))
+         {
+            freeLayout(state);
+            memset(state, 0, sizeof(*state));
+            munmap(data, size);
+            return 0;
+         }
+         state->controlledBy = calloc(state->nodeCount, sizeof(state->controlledBy[0]));
+         state->mapping = data;
+         state->mappingSize = size;
+         return 1;
+      }
+   }
+   if (data != MAP_FAILED)
+      munmap(data, size);
+
+   // A game file in the text form is read (and copied) the usual way
+   FILE* f = fdopen(fd, "r");
+   if (!f)
+   {
+      close(fd);
+      return 0;
+   }
+   int read = readGameFile(f, state);
+   fclose(f);
+   return read;
+}
+
+void unmapGameFile(struct GameState* state)
+{
+   freeLayout(state);
+   free(state->controlledBy);
+   freeScratch(&state->scratch);
+   munmap(state->mapping, state->mappingSize);
+   memset(state, 0, sizeof(*state));
+}
+
+static void putWord(unsigned char* bytes, uint32_t word)
+{
+   for (unsigned i = 0; i < 4; ++i)
+      bytes[i] = (word >> (8 * i)) & 0xff;
+}
+
+static uint32_t getWord(const unsigned char* bytes)
+{
+   return bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+int appendToJournal(const char* path, const struct GameState* state, unsigned player,
+                    enum OrderType type, unsigned from, unsigned to)
+{
+   unsigned char bytes[JOURNALHEADERSIZE + JOURNALRECORDSIZE];
+   memcpy(bytes, JOURNALMAGIC, 4);
+   putWord(bytes + 4, state->journalSequence);
+   unsigned char* record = bytes + JOURNALHEADERSIZE;
+   putWord(record, state->turnCount);
+   putWord(record + 4, player);
+   putWord(record + 8, type);
+   putWord(record + 12, from);
+   putWord(record + 16, to);
+
+   int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+   if (fd == -1)
+      return 0;
+
+   // A journal of this game file gets the record, after any record cut short
+   // (by a crash, halfway through appending it) is cut off so that the new one
+   // starts where it should. Anything else is made anew with the header first.
+   unsigned char header[JOURNALHEADERSIZE];
+   struct stat st;
+   int written;
+   if (pread(fd, header, JOURNALHEADERSIZE, 0) == JOURNALHEADERSIZE && !memcmp(header, JOURNALMAGIC, 4) &&
+       getWord(header + 4) == state->journalSequence && !fstat(fd, &st))
+   {
+      off_t whole = JOURNALHEADERSIZE + (st.st_size - JOURNALHEADERSIZE) / JOURNALRECORDSIZE * JOURNALRECORDSIZE;
+      written = (whole == st.st_size || !ftruncate(fd, whole)) &&
+                write(fd, record, JOURNALRECORDSIZE) == JOURNALRECORDSIZE;
+   }
+   else
+      written = !ftruncate(fd, 0) && write(fd, bytes, sizeof(bytes)) == sizeof(bytes);
+   close(fd);
+   return written;
+}
+
+unsigned replayJournal(const char* path, struct GameState* state)
+{
+   FILE* f = fopen(path, "rb");
+   if (!f)
+      return 0;
+
+   unsigned char header[JOURNALHEADERSIZE];
+   if (fread(header, 1, JOURNALHEADERSIZE, f) != JOURNALHEADERSIZE || memcmp(header, JOURNALMAGIC, 4) ||
+       getWord(header + 4) != state->journalSequence)
+   {
+      fclose(f);
+      return 0;
+   }
+
+   // A record cut short can only be the last one (appending cuts it off before
+   // going on), and is left out
+   unsigned replayed = 0;
+   unsigned char record[JOURNALRECORDSIZE];
+   while (fread(record, 1, sizeof(record), f) == sizeof(record))
+   {
+      unsigned player = getWord(record + 4);
+      // Orders for turns since ticked are in the game file already
+      if (getWord(record) != state->turnCount || player >= state->playerCount)
+         continue;
+      if (!replayed)
+         stepGameHistoryLatest(state);
+      addOrder(state, getWord(record + 8), getWord(record + 12), getWord(record + 16), state->playerSecret[player]);
+      ++replayed;
+   }
+   fclose(f);
+   return replayed;
+}
@@ -0,0 +1,80 @@
+#ifndef GAMEFILE_H
+#define GAMEFILE_H
+
+#include <stdio.h>
+
+#include "game.h"
+
+/*
+  The compact binary form games are stored in, on the server. The text form
+  of serialize() is still what the client gets, and older game files in that
+  form can still be read.
+
+  A binary game file starts with GAMEFILEMAGIC and a 32 bit version, and
+  everything after is little-endian. It has a fixed header of counts, the
+  journal sequence and the seed, the strings in fixed size slots, and then
+  each array of GameState just as it is held in memory, 32 bit words aligned
+  to 16 bytes, so that a file can be mapped and used without being parsed.
+  Only the history, which is most of a long game, is coded to be small
+  instead: LEB128 varints, the orders of each turn in runs by player, their
+  from nodes as the gaps between them and their to nodes as which neighbour
+  they are. See writeGameFile() and writeHistory() for the order of
+  everything.
+*/
+
+#define GAMEFILEMAGIC "OWG\x01"
+#define GAMEFILEVERSION 1
+
+// Writes all of the game, secrets included, in the binary form
+void writeGameFile(struct GameState* state, FILE* f);
+
+// Reads a game file in either form ('f' must be a file that can be rewound).
+// Returns 0 if it could not be read (a binary one being cut short, or of a
+// version we don't know), in which case 'state' still needs freeing.
+int readGameFile(FILE* f, struct GameState* state);
+
+// Maps a binary game file into memory and points 'state' into it, rather than
+// copying it, which is what read-only requests want (only the history is
+// decoded). Such a state must not be changed
+// (no orders added, no history stepped through) and its file not written over
+// while it is mapped; freeGameState() unmaps it. Files in the text form are
+// read as by readGameFile(). Returns 0 if the file could not be opened or
+// read.
+int mapGameFile(const char* path, struct GameState* state);
+
+// Frees a state made by mapGameFile() (see freeGameState())
+void unmapGameFile(struct GameState* state);
+
+/*
+  Orders given since a game file was last written are kept in a journal next
+  to it, so that giving an order appends a record instead of writing out the
+  whole game. Each record is JOURNALRECORDSIZE bytes: the turn count of the
+  game when the order was given, then the player, order type, from node and
+  to node, all 32 bit little-endian. The journal is folded into the game file
+  whenever that is written.
+
+  The records follow a JOURNALHEADERSIZE byte header: JOURNALMAGIC, then the
+  journalSequence of the game file the orders were given on. Writing the game
+  file counts its journalSequence up before the journal is removed, so a
+  journal left behind by a crash in between (its orders being in the file
+  already) no longer matches and is not replayed.
+*/
+
+#define JOURNALMAGIC "OWJ\x01"
+#define JOURNALHEADERSIZE 8
+#define JOURNALRECORDSIZE 20
+
+// Appends an order given by 'player' in the current turn (one addOrder() took)
+// to the journal at 'path', starting the journal anew if it is stale and
+// cutting off a record left half written. Returns 0 if it could not be
+// written.
+int appendToJournal(const char* path, const struct GameState* state, unsigned player,
+                    enum OrderType type, unsigned from, unsigned to);
+
+// Gives the orders in the journal at 'path' for the current turn of 'state'
+// again, with addOrder(), after stepping the history up to that turn. Orders
+// for turns that have been ticked since are skipped, and a missing or stale
+// journal is an empty one. Returns the number of orders replayed.
+unsigned replayJournal(const char* path, struct GameState* state);
+
+#endif
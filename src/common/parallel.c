@@ -0,0 +1,114 @@
+#include "parallel.h"
+
+#ifdef PARALLEL_GENERATION
+#include <pthread.h>
+#include <stdlib.h>
+#endif
+
+static unsigned threadCount = 1;
+
+#ifdef PARALLEL_GENERATION
+// Set on the threads running chunks, so nested parallelFor()s don't start threads of their own
+static _Thread_local int runningChunks = 0;
+#endif
+
+unsigned parallelThreadCount()
+{
+   return threadCount;
+}
+
+void setParallelThreadCount(unsigned count)
+{
+#ifdef PARALLEL_GENERATION
+   threadCount = count > 0 ? count : 1;
+#else
+   (void)count;
+#endif
+}
+
+#ifdef PARALLEL_GENERATION
+struct ParallelWork
+{
+   unsigned count;
+   unsigned grain;
+   ParallelBody body;
+   void* context;
+
+   pthread_mutex_t mutex;
+   unsigned nextChunk;
+};
+
+struct ParallelThread
+{
+   struct ParallelWork* work;
+   unsigned thread;
+};
+
+static void runChunks(struct ParallelWork* work, unsigned thread)
+{
+   unsigned chunkCount = parallelChunkCount(work->count, work->grain);
+   runningChunks = 1;
+   while (1)
+   {
+      pthread_mutex_lock(&work->mutex);
+      unsigned chunk = work->nextChunk++;
+      pthread_mutex_unlock(&work->mutex);
+      if (chunk >= chunkCount)
+         break;
+
+      unsigned begin = chunk * work->grain;
+      unsigned end = work->count - begin < work->grain ? work->count : begin + work->grain;
+      work->body(work->context, begin, end, thread);
+   }
+   runningChunks = 0;
+}
+
+static void* parallelThread(void* arg)
+{
+   struct ParallelThread* thread = arg;
+   runChunks(thread->work, thread->thread);
+   return NULL;
+}
+#endif
+
+void parallelFor(unsigned count, unsigned grain, ParallelBody body, void* context)
+{
+   if (grain == 0)
+      grain = 1;
+   unsigned chunkCount = parallelChunkCount(count, grain);
+
+#ifdef PARALLEL_GENERATION
+   // Not worth starting threads for a single chunk
+   unsigned helperCount = (threadCount < chunkCount ? threadCount : chunkCount);
+   helperCount = helperCount > 1 && !runningChunks ? helperCount - 1 : 0;
+   if (helperCount)
+   {
+      struct ParallelWork work = {count, grain, body, context, PTHREAD_MUTEX_INITIALIZER, 0};
+
+      pthread_t* helpers = malloc(helperCount * sizeof(helpers[0]));
+      struct ParallelThread* helperThread = malloc(helperCount * sizeof(helperThread[0]));
+      unsigned started = 0;
+      for (; started < helperCount; ++started)
+      {
+         helperThread[started].work = &work;
+         helperThread[started].thread = started + 1;
+         if (pthread_create(&helpers[started], NULL, parallelThread, &helperThread[started]))
+            break; // The threads we did get will do all the chunks anyway
+      }
+      runChunks(&work, 0);
+      for (unsigned i = 0; i < started; ++i)
+         pthread_join(helpers[i], NULL);
+
+      pthread_mutex_destroy(&work.mutex);
+      free(helpers);
+      free(helperThread);
+      return;
+   }
+#endif
+
+   for (unsigned chunk = 0; chunk < chunkCount; ++chunk)
+   {
+      unsigned begin = chunk * grain;
+      body(context, begin, count - begin < grain ? count : begin + grain, 0);
+   }
+}
@@ -0,0 +1,30 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/*
+  Spreads the data parallel parts of map generation over threads, when built
+  with -DPARALLEL_GENERATION (the server is, the web client is not, and simply
+  runs everything on the calling thread).
+
+  parallelFor() splits [0, count) into chunks of 'grain' items and calls
+  'body' for each chunk, from whichever thread gets to it first. The chunks
+  are the same whatever the number of threads, so as long as a body only
+  writes to its own items (or to one result per chunk, merged in chunk order
+  afterwards), the outcome never depends on the thread count. 'thread' is
+  below parallelThreadCount(), for bodies that need working memory of their
+  own. A parallelFor() called from within a body runs on the calling thread.
+*/
+
+typedef void (*ParallelBody)(void* context, unsigned begin, unsigned end, unsigned thread);
+
+void parallelFor(unsigned count, unsigned grain, ParallelBody body, void* context);
+
+// How many chunks parallelFor() splits 'count' items into
+static inline unsigned parallelChunkCount(unsigned count, unsigned grain) { return (count + grain - 1) / grain; };
+
+// The number of threads parallelFor() uses, the calling one included (1 by default)
+unsigned parallelThreadCount();
+
+void setParallelThreadCount(unsigned threadCount);
+
+#endif
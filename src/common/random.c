@@ -0,0 +1,17 @@
+#include "random.h"
+
+struct Random seedRandom(uint64_t seed)
+{
+   struct Random random;
+   random.state = seed;
+   return random;
+}
+
+unsigned nextRandom(struct Random* random)
+{
+   uint64_t z = (random->state += 0x9E3779B97F4A7C15ull);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+   z = z ^ (z >> 31);
+   return (unsigned)(z >> 32);
+}
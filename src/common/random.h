@@ -0,0 +1,19 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+// A small random number generator (splitmix64) with all of its state in the
+// struct, so that each game can have its own, seeded, and the exact same map
+// can be generated again from nothing but the seed.
+struct Random
+{
+   uint64_t state;
+};
+
+struct Random seedRandom(uint64_t seed);
+
+// The next 32 random bits
+unsigned nextRandom(struct Random* random);
+
+#endif
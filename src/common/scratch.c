@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scratch.h"
+
+#define SCRATCHALIGN 16
+#define SCRATCHMINBLOCK 4096
+
+struct ScratchBlock
+{
+   struct ScratchBlock* previous;
+   size_t size;
+   size_t used;
+   char* memory;
+};
+
+static struct ScratchBlock* createBlock(size_t size)
+{
+   struct ScratchBlock* block = malloc(sizeof(*block) + SCRATCHALIGN + size);
+   uintptr_t start = (uintptr_t)(block + 1);
+   block->memory = (char*)((start + SCRATCHALIGN - 1) & ~(uintptr_t)(SCRATCHALIGN - 1));
+   block->size = size;
+   block->used = 0;
+   block->previous = NULL;
+   return block;
+}
+
+struct ScratchPosition scratchSave(struct Scratch* scratch)
+{
+   struct ScratchPosition position;
+   position.block = scratch->block;
+   position.used = scratch->block ? scratch->block->used : 0;
+   return position;
+}
+
+void scratchRestore(struct Scratch* scratch, struct ScratchPosition position)
+{
+   // Hand back the blocks taken since, keeping the largest one around, so that
+   // doing the same work again won't need to malloc.
+   while (scratch->block != position.block)
+   {
+      struct ScratchBlock* block = scratch->block;
+      scratch->block = block->previous;
+      if (!scratch->spare || block->size > scratch->spare->size)
+      {
+         free(scratch->spare);
+         scratch->spare = block;
+      }
+      else
+         free(block);
+   }
+   if (scratch->block)
+      scratch->block->used = position.used;
+}
+
+void* scratchAlloc(struct Scratch* scratch, size_t size)
+{
+   size = (size + SCRATCHALIGN - 1) & ~(size_t)(SCRATCHALIGN - 1);
+
+   struct ScratchBlock* block = scratch->block;
+   if (!block || block->size - block->used < size)
+   {
+      // Grow geometrically, so that the number of blocks stays small
+      size_t blockSize = block ? block->size * 2 : SCRATCHMINBLOCK;
+      if (blockSize < size)
+         blockSize = size;
+
+      if (scratch->spare && scratch->spare->size >= size)
+      {
+         block = scratch->spare;
+         scratch->spare = NULL;
+      }
+      else
+         block = createBlock(blockSize);
+      block->used = 0;
+      block->previous = scratch->block;
+      scratch->block = block;
+   }
+
+   void* memory = block->memory + block->used;
+   block->used += size;
+   return memory;
+}
+
+void clearMarks(struct Scratch* scratch, unsigned count)
+{
+   if (count > scratch->markCapacity)
+   {
+      free(scratch->marks);
+      scratch->marks = calloc(count, sizeof(scratch->marks[0]));
+      scratch->markCapacity = count;
+      scratch->markGeneration = 1;
+      return;
+   }
+
+   // Once in four billion times, old marks could come back to life
+   if (++scratch->markGeneration == 0)
+   {
+      memset(scratch->marks, 0, scratch->markCapacity * sizeof(scratch->marks[0]));
+      scratch->markGeneration = 1;
+   }
+}
+
+void freeScratch(struct Scratch* scratch)
+{
+   scratchRestore(scratch, (struct ScratchPosition){0});
+   free(scratch->spare);
+   free(scratch->marks);
+   memset(scratch, 0, sizeof(*scratch));
+}
@@ -0,0 +1,53 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+/*
+  Reusable working memory for the algorithms that walk the graph, so that
+  they neither depend on the node count fitting on the stack, nor need to
+  malloc and clear their arrays on every call.
+
+  Memory is handed out like a stack: remember where the scratch is with
+  scratchSave(), take what you need with scratchAlloc(), and give all of it
+  back with scratchRestore(). Memory is not cleared when handed out.
+
+  Marks are a "visited" array that never needs clearing. A node is marked as
+  long as its entry equals the current generation, so clearMarks() simply
+  moves on to the next generation. There is only the one set of marks, so a
+  function using them must not call anything else that does.
+*/
+
+struct ScratchBlock;
+
+struct Scratch
+{
+   struct ScratchBlock* block;
+   struct ScratchBlock* spare; // the largest block given back, kept for reuse
+
+   unsigned* marks;
+   unsigned markCapacity;
+   unsigned markGeneration;
+};
+
+struct ScratchPosition
+{
+   struct ScratchBlock* block;
+   size_t used;
+};
+
+struct ScratchPosition scratchSave(struct Scratch* scratch);
+
+void scratchRestore(struct Scratch* scratch, struct ScratchPosition position);
+
+void* scratchAlloc(struct Scratch* scratch, size_t size);
+
+// Unmarks everything, and makes room for marking 'count' nodes
+void clearMarks(struct Scratch* scratch, unsigned count);
+
+static inline void setMark(struct Scratch* scratch, unsigned node) { scratch->marks[node] = scratch->markGeneration; };
+static inline int isMarked(const struct Scratch* scratch, unsigned node) { return scratch->marks[node] == scratch->markGeneration; };
+
+void freeScratch(struct Scratch* scratch);
+
+#endif
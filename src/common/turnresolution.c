@@ -18,75 +18,320 @@
 #define FIXED_MASK 0x0000FFFF
 typedef uint32_t fixed_real;
 
-static fixed_real calculateStrengthInternal(struct GameState* game, struct Turn* turn, unsigned node, unsigned* pinned, unsigned* visited)
+// How many turns apart the controlledBy checkpoints are. Reaching any turn costs
+// at most this many resolutions, on top of copying the nearest checkpoint.
+#define CHECKPOINT_INTERVAL 8
+
+// The orders of a turn, bucketed by the node they target, plus the number of
+// orders issued from each node. Built once per turn, so that nobody needs to
+// look through every order of the turn for every node. Lives in the scratch
+// memory of the game.
+struct OrderIndex
 {
-   fixed_real strength = 1 << FIXED_SHIFT;
+   unsigned* toOffsets; // nodeCount+1, orders targeting node n are toOrders[toOffsets[n]] .. toOrders[toOffsets[n+1]-1]
+   unsigned* toOrders;  // order numbers, in the same relative order as in the turn
+   unsigned* fromCount; // how many orders each node has issued (the "split order count")
+};
+
+static struct OrderIndex buildOrderIndex(struct GameState* game, struct Turn* turn)
+{
+   struct OrderIndex index;
+   index.toOffsets = scratchAlloc(&game->scratch, (game->nodeCount + 1) * sizeof(index.toOffsets[0]));
+   index.toOrders = scratchAlloc(&game->scratch, turn->orderCount * sizeof(index.toOrders[0]));
+   index.fromCount = scratchAlloc(&game->scratch, game->nodeCount * sizeof(index.fromCount[0]));
+   memset(index.toOffsets, 0, (game->nodeCount + 1) * sizeof(index.toOffsets[0]));
+   memset(index.fromCount, 0, game->nodeCount * sizeof(index.fromCount[0]));
+
+   // Count, then turn the counts into offsets (surrenders target no node at all)
    for (unsigned order = 0; order < turn->orderCount; ++order)
    {
-      if (turn->toNode[order] == node &&
-	  turn->type[order] == SUPPORTORDER &&
-	  nodesConnect(game, node, turn->fromNode[order]) &&
-	  !pinned[turn->fromNode[order]] &&
+      if (turn->toNode[order] < game->nodeCount)
+         ++index.toOffsets[turn->toNode[order] + 1];
+      if (turn->fromNode[order] < game->nodeCount)
+         ++index.fromCount[turn->fromNode[order]];
+   }
+   for (unsigned node = 0; node < game->nodeCount; ++node)
+   {
+      index.toOffsets[node + 1] += index.toOffsets[node];
+   }
+
+   // Order matters when resolving ties, so fill each bucket in turn order
+   struct ScratchPosition position = scratchSave(&game->scratch);
+   unsigned* fill = scratchAlloc(&game->scratch, game->nodeCount * sizeof(fill[0]));
+   memcpy(fill, index.toOffsets, game->nodeCount * sizeof(fill[0]));
+   for (unsigned order = 0; order < turn->orderCount; ++order)
+   {
+      if (turn->toNode[order] < game->nodeCount)
+         index.toOrders[fill[turn->toNode[order]]++] = order;
+   }
+   scratchRestore(&game->scratch, position);
+
+   return index;
+}
+
+// Does 'order' give 'node' support that counts?
+static int isSupportOf(struct GameState* game, struct Turn* turn, unsigned order, unsigned node, unsigned* pinned)
+{
+   return turn->type[order] == SUPPORTORDER &&
+      nodesConnect(game, node, turn->fromNode[order]) &&
+      !pinned[turn->fromNode[order]];
+}
+
+#ifdef VERIFY_RESOLUTION
+// The original, recursive, strength calculation. Kept only to check the iterative one against.
+static fixed_real calculateStrengthRecursive(struct GameState* game, struct Turn* turn, struct OrderIndex* index,
+                                             unsigned node, unsigned* pinned, unsigned* visited)
+{
+   fixed_real strength = 1 << FIXED_SHIFT;
+   for (unsigned i = index->toOffsets[node]; i < index->toOffsets[node+1]; ++i)
+   {
+      unsigned order = index->toOrders[i];
+      if (isSupportOf(game, turn, order, node, pinned) &&
           !visited[turn->fromNode[order]])
       {
          // 'turn->fromNode[order]' supports 'node' and is not pinned
          visited[turn->fromNode[order]] = 1;
-         strength += calculateStrengthInternal(game, turn, turn->fromNode[order], pinned, visited) / 2;
+         strength += calculateStrengthRecursive(game, turn, index, turn->fromNode[order], pinned, visited) / 2;
       }
    }
 
    // How many total orders from that same node?
-   unsigned splitOrderCount = 0;
-   for (unsigned order = 0; order < turn->orderCount; ++order)
-   {
-      if (turn->fromNode[order] == node)
-         ++splitOrderCount;
-   }
+   unsigned splitOrderCount = index->fromCount[node];
 
    if (splitOrderCount)
       return strength / splitOrderCount;
    return strength;
 }
+#endif
 
-static fixed_real calculateStrength(struct GameState* game, struct Turn* turn, unsigned node, unsigned* pinned)
+// The strength of a node is the sum of the strengths of its supporters (each
+// halved), which in turn depends on their supporters, and so on. Each node may
+// only count once per evaluation, so in general the result depends on the way
+// the evaluation happened to reach it. But if none of the nodes (directly or
+// indirectly) supporting a node support anything else, and there are no
+// cycles, they form a tree that nothing else can reach into. The strength of
+// such a "memoizable" node is then the same however it is reached, and only
+// needs calculating once per turn. Lives in the scratch memory of the game.
+struct SupportMemo
 {
-   if (game->controlledBy[node] == -1)
-      return (1 << FIXED_SHIFT) / 2; // Neutral nodes have a set strength, and cannot receive support
+   unsigned* memoizable;
+   unsigned* known;
+   fixed_real* strength;
+};
 
-   unsigned visited[game->nodeCount];
-   memset(visited, 0, sizeof(visited[0]) * game->nodeCount);
-   visited[node] = 1; // Can't support yourself
-   return calculateStrengthInternal(game, turn, node, pinned, visited);
+static struct SupportMemo buildSupportMemo(struct GameState* game, struct Turn* turn, struct OrderIndex* index, unsigned* pinned)
+{
+   struct Scratch* scratch = &game->scratch;
+   struct SupportMemo memo;
+   memo.memoizable = scratchAlloc(scratch, game->nodeCount * sizeof(memo.memoizable[0]));
+   memo.known = scratchAlloc(scratch, game->nodeCount * sizeof(memo.known[0]));
+   memo.strength = scratchAlloc(scratch, game->nodeCount * sizeof(memo.strength[0]));
+   memset(memo.memoizable, 0, game->nodeCount * sizeof(memo.memoizable[0]));
+   memset(memo.known, 0, game->nodeCount * sizeof(memo.known[0]));
+
+   struct ScratchPosition position = scratchSave(scratch);
+
+   // How many nodes does each node support?
+   unsigned* supportedCount = scratchAlloc(scratch, game->nodeCount * sizeof(supportedCount[0]));
+   memset(supportedCount, 0, sizeof(supportedCount[0]) * game->nodeCount);
+   for (unsigned node = 0; node < game->nodeCount; ++node)
+   {
+      for (unsigned i = index->toOffsets[node]; i < index->toOffsets[node+1]; ++i)
+      {
+         if (isSupportOf(game, turn, index->toOrders[i], node, pinned))
+            ++supportedCount[turn->fromNode[index->toOrders[i]]];
+      }
+   }
+
+   // Depth first, from supported to supporter. A node is memoizable if all
+   // its supporters support only it, are memoizable themselves, and are not
+   // still being explored (which would make it a cycle).
+   enum { UNEXPLORED, EXPLORING, EXPLORED };
+   unsigned* exploration = scratchAlloc(scratch, game->nodeCount * sizeof(exploration[0]));
+   memset(exploration, 0, sizeof(exploration[0]) * game->nodeCount);
+   unsigned* stackNode = scratchAlloc(scratch, game->nodeCount * sizeof(stackNode[0]));
+   unsigned* stackCursor = scratchAlloc(scratch, game->nodeCount * sizeof(stackCursor[0]));
+   for (unsigned root = 0; root < game->nodeCount; ++root)
+   {
+      if (exploration[root] != UNEXPLORED)
+         continue;
+
+      unsigned depth = 0;
+      stackNode[depth] = root;
+      stackCursor[depth++] = index->toOffsets[root];
+      exploration[root] = EXPLORING;
+      memo.memoizable[root] = 1;
+      while (depth)
+      {
+         unsigned node = stackNode[depth-1];
+         if (stackCursor[depth-1] < index->toOffsets[node+1])
+         {
+            unsigned order = index->toOrders[stackCursor[depth-1]++];
+            if (!isSupportOf(game, turn, order, node, pinned))
+               continue;
+
+            unsigned supporter = turn->fromNode[order];
+            if (supportedCount[supporter] != 1 || exploration[supporter] == EXPLORING)
+            {
+               memo.memoizable[node] = 0;
+            }
+            else if (exploration[supporter] == EXPLORED)
+            {
+               if (!memo.memoizable[supporter])
+                  memo.memoizable[node] = 0;
+            }
+            else
+            {
+               stackNode[depth] = supporter;
+               stackCursor[depth++] = index->toOffsets[supporter];
+               exploration[supporter] = EXPLORING;
+               memo.memoizable[supporter] = 1;
+            }
+         }
+         else
+         {
+            exploration[node] = EXPLORED;
+            --depth;
+            if (depth && !memo.memoizable[node])
+               memo.memoizable[stackNode[depth-1]] = 0;
+         }
+      }
+   }
+
+   scratchRestore(scratch, position);
+   return memo;
 }
 
-static int existsControlledPathToInt(struct GameState* game, unsigned from, unsigned to, unsigned playerId, unsigned* visited)
+// Walks the supporters of 'root' depth first, with an explicit stack rather
+// than recursion, so that long support chains can't run us out of C stack.
+static fixed_real calculateStrengthInternal(struct GameState* game, struct Turn* turn, struct OrderIndex* index,
+                                            struct SupportMemo* memo, unsigned root, unsigned* pinned)
 {
-   if (from == to)
-      return 1;
-   
-   unsigned connectedCount = 0;
-   unsigned connected[game->nodeCount];
-   getConnectedNodes(game, from, connected, &connectedCount);
+   if (memo->known[root])
+      return memo->strength[root];
+
+   // Marked nodes have been visited
+   struct Scratch* scratch = &game->scratch;
+   clearMarks(scratch, game->nodeCount);
+   setMark(scratch, root); // Can't support yourself
+
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned* stackNode = scratchAlloc(scratch, game->nodeCount * sizeof(stackNode[0]));
+   unsigned* stackCursor = scratchAlloc(scratch, game->nodeCount * sizeof(stackCursor[0]));
+   fixed_real* stackStrength = scratchAlloc(scratch, game->nodeCount * sizeof(stackStrength[0]));
+   unsigned depth = 0;
+   stackNode[depth] = root;
+   stackCursor[depth] = index->toOffsets[root];
+   stackStrength[depth++] = 1 << FIXED_SHIFT;
 
-   visited[from] = 1;
-   for (unsigned i = 0; i < connectedCount; ++i)
+   fixed_real rootStrength = 0;
+   while (depth)
    {
-      unsigned node = connected[i];
-      if (!visited[node] && game->controlledBy[node] == playerId)
+      unsigned node = stackNode[depth-1];
+      if (stackCursor[depth-1] < index->toOffsets[node+1])
       {
-         if (existsControlledPathToInt(game, node, to, playerId, visited))
-	    return 1;
+         unsigned order = index->toOrders[stackCursor[depth-1]++];
+         unsigned supporter = turn->fromNode[order];
+         if (!isSupportOf(game, turn, order, node, pinned) || isMarked(scratch, supporter))
+            continue;
+
+         // 'supporter' supports 'node' and is not pinned
+         setMark(scratch, supporter);
+         if (memo->known[supporter])
+         {
+            stackStrength[depth-1] += memo->strength[supporter] / 2;
+         }
+         else
+         {
+            stackNode[depth] = supporter;
+            stackCursor[depth] = index->toOffsets[supporter];
+            stackStrength[depth++] = 1 << FIXED_SHIFT;
+         }
+         continue;
       }
+
+      // All supporters of 'node' accounted for. How many total orders from that same node?
+      fixed_real strength = stackStrength[depth-1];
+      unsigned splitOrderCount = index->fromCount[node];
+      if (splitOrderCount)
+         strength = strength / splitOrderCount;
+
+      if (memo->memoizable[node])
+      {
+         memo->known[node] = 1;
+         memo->strength[node] = strength;
+      }
+
+      if (--depth)
+         stackStrength[depth-1] += strength / 2;
+      else
+         rootStrength = strength;
    }
 
-   return 0;
+   scratchRestore(scratch, position);
+   return rootStrength;
 }
 
-static int existsControlledPathTo(struct GameState* game, unsigned from, unsigned to, unsigned playerId)
+static fixed_real calculateStrength(struct GameState* game, struct Turn* turn, struct OrderIndex* index,
+                                    struct SupportMemo* memo, unsigned node, unsigned* pinned)
 {
-   unsigned visited[game->nodeCount];
+   if (game->controlledBy[node] == -1)
+      return (1 << FIXED_SHIFT) / 2; // Neutral nodes have a set strength, and cannot receive support
+
+   fixed_real strength = calculateStrengthInternal(game, turn, index, memo, node, pinned);
+
+#ifdef VERIFY_RESOLUTION
+   struct ScratchPosition position = scratchSave(&game->scratch);
+   unsigned* visited = scratchAlloc(&game->scratch, game->nodeCount * sizeof(visited[0]));
    memset(visited, 0, sizeof(visited[0]) * game->nodeCount);
-   return existsControlledPathToInt(game, from, to, playerId, visited);
+   visited[node] = 1;
+   fixed_real reference = calculateStrengthRecursive(game, turn, index, node, pinned, visited);
+   scratchRestore(&game->scratch, position);
+   if (strength != reference)
+   {
+      fprintf(stderr, "Strength of node %u in game %s is %u, but %u by the recursive reference\n",
+              node, game->id, strength, reference);
+      abort();
+   }
+#endif
+
+   return strength;
+}
+
+static int existsControlledPathTo(struct GameState* game, unsigned from, unsigned to, unsigned playerId)
+{
+   // Depth first, with the visited nodes marked
+   struct Scratch* scratch = &game->scratch;
+   struct ScratchPosition position = scratchSave(scratch);
+   unsigned* stack = scratchAlloc(scratch, game->nodeCount * sizeof(stack[0]));
+   clearMarks(scratch, game->nodeCount);
+
+   int found = 0;
+   unsigned depth = 0;
+   stack[depth++] = from;
+   setMark(scratch, from);
+   while (depth)
+   {
+      unsigned node = stack[--depth];
+      if (node == to)
+      {
+         found = 1;
+         break;
+      }
+
+      for (unsigned i = game->adjacencyOffsets[node]; i < game->adjacencyOffsets[node+1]; ++i)
+      {
+         unsigned connected = game->adjacencyList[i];
+         if (!isMarked(scratch, connected) && game->controlledBy[connected] == playerId)
+         {
+            setMark(scratch, connected);
+            stack[depth++] = connected;
+         }
+      }
+   }
+
+   scratchRestore(scratch, position);
+   return found;
 }
 
 static void findPinnedWorlds(struct GameState* game, struct Turn* turn, unsigned* pinned)
@@ -108,16 +353,20 @@ static int resolveTurn(struct GameState* game, unsigned turnIndex)
    struct Turn* turn = &game->turn[turnIndex];
    int gameStateWasChanged = 0;
 
+   struct ScratchPosition position = scratchSave(&game->scratch);
+   struct OrderIndex index = buildOrderIndex(game, turn);
+
    // Pinning
-   unsigned pinned[game->nodeCount];
+   unsigned* pinned = scratchAlloc(&game->scratch, game->nodeCount * sizeof(pinned[0]));
    findPinnedWorlds(game, turn, pinned);
+   struct SupportMemo memo = buildSupportMemo(game, turn, &index, pinned);
    
    // calculate all node strengths
-   fixed_real nodeStrength[game->nodeCount];
+   fixed_real* nodeStrength = scratchAlloc(&game->scratch, game->nodeCount * sizeof(nodeStrength[0]));
    memset(nodeStrength, 0, sizeof(nodeStrength[0]) * game->nodeCount);
    for (unsigned node = 0; node < game->nodeCount; ++node)
    {
-      nodeStrength[node] = calculateStrength(game, turn, node, pinned);
+      nodeStrength[node] = calculateStrength(game, turn, &index, &memo, node, pinned);
    }
 
    // Battles
@@ -127,10 +376,10 @@ static int resolveTurn(struct GameState* game, unsigned turnIndex)
       unsigned strongestAttackingPlayer = -1;
       unsigned strongestAttackingCandidate = -1;
       fixed_real candidateStrength = 0;
-      for (unsigned order = 0; order < turn->orderCount; ++order)
+      for (unsigned i = index.toOffsets[node]; i < index.toOffsets[node+1]; ++i)
       {
-         if (turn->toNode[order] == node &&
-             turn->type[order] == ATTACKORDER &&
+         unsigned order = index.toOrders[i];
+         if (turn->type[order] == ATTACKORDER &&
              nodesConnect(game, node, turn->fromNode[order]))
          {
             // Judge strength of attack
@@ -154,12 +403,7 @@ static int resolveTurn(struct GameState* game, unsigned turnIndex)
       {
          // How many total orders from that same node? Because splitting a nodes power only affects
          // it's offence and support, _not_ it's defence.
-         unsigned splitOrderCount = 0;
-         for (unsigned order = 0; order < turn->orderCount; ++order)
-         {
-            if (turn->fromNode[order] == node)
-               ++splitOrderCount;
-         }
+         unsigned splitOrderCount = index.fromCount[node];
 
          // This is _super_ tricky! Saying "candidateStrength > splitOrderCount * nodeStrength[node]" would
          // make a lot more sense to a human reader, BUT we're dealing with finite precision real numbers now,
@@ -180,20 +424,22 @@ static int resolveTurn(struct GameState* game, unsigned turnIndex)
    }
 
    // Surrenders
+   unsigned* surrendering = scratchAlloc(&game->scratch, game->playerCount * sizeof(surrendering[0]));
+   memset(surrendering, 0, sizeof(surrendering[0]) * game->playerCount);
    for (unsigned order = 0; order < turn->orderCount; ++order)
    {
-      if (turn->type[order] == SURRENDERORDER)
+      if (turn->type[order] == SURRENDERORDER && turn->issuingPlayer[order] < game->playerCount)
+         surrendering[turn->issuingPlayer[order]] = 1;
+   }
+   for (unsigned node = 0; node < game->nodeCount; ++node)
+   {
+      if (game->controlledBy[node] != UINT_MAX && surrendering[game->controlledBy[node]])
       {
-         for (unsigned node = 0; node < game->nodeCount; ++node)
-         {
-            if (game->controlledBy[node] == turn->issuingPlayer[order])
-            {
-               game->controlledBy[node] = UINT_MAX; 
-            }
-         }
+         game->controlledBy[node] = UINT_MAX; 
       }
    }
-   
+
+   scratchRestore(&game->scratch, position);
    return gameStateWasChanged;
 }
 
@@ -213,18 +459,78 @@ void tickGame(struct GameState* game)
    game->turn[game->turnCount-1].type = malloc(0);
 }
 
+static void storeCheckpoint(struct GameState* game)
+{
+   game->checkpointCount++;
+   game->checkpoints = realloc(game->checkpoints,
+                               sizeof(game->checkpoints[0]) * game->checkpointCount * game->nodeCount);
+   memcpy(&game->checkpoints[(game->checkpointCount-1) * game->nodeCount], game->controlledBy,
+          sizeof(game->controlledBy[0]) * game->nodeCount);
+}
+
+#ifdef VERIFY_RESOLUTION
+// Replays the whole history from the initial state, the slow way, and makes sure
+// we ended up exactly where the checkpoints took us.
+static void verifyAgainstFullReplay(struct GameState* game, unsigned steps)
+{
+   struct ScratchPosition position = scratchSave(&game->scratch);
+   unsigned* checkpointed = game->controlledBy;
+   unsigned* replayed = scratchAlloc(&game->scratch, game->nodeCount * sizeof(replayed[0]));
+   memcpy(replayed, game->controlledByInitial, sizeof(replayed[0]) * game->nodeCount);
+
+   game->controlledBy = replayed;
+   for (unsigned i = 0; i < steps; ++i)
+   {
+      resolveTurn(game, i);
+   }
+   game->controlledBy = checkpointed;
+
+   if (memcmp(replayed, checkpointed, sizeof(replayed[0]) * game->nodeCount))
+   {
+      fprintf(stderr, "Checkpointed state of game %s diverges from full replay at turn %u\n", game->id, steps);
+      abort();
+   }
+   scratchRestore(&game->scratch, position);
+}
+#endif
+
 void stepGameHistory(struct GameState* game, unsigned targetStep)
 {
-   // Copy the initial state as the current one
-   memcpy(game->controlledBy, game->controlledByInitial, sizeof(game->controlledByInitial[0]) * game->nodeCount);
-   
    unsigned steps = targetStep > game->turnCount-1 ? game->turnCount-1 : targetStep;
 
-   for (unsigned i = 0; i < steps; ++i)
+   // Checkpoints taken at some other interval are of no use to us, start over
+   if (game->checkpointInterval != CHECKPOINT_INTERVAL)
+   {
+      free(game->checkpoints);
+      game->checkpoints = NULL;
+      game->checkpointCount = 0;
+      game->checkpointInterval = CHECKPOINT_INTERVAL;
+   }
+
+   // Start from the latest checkpoint not beyond the target, or from the initial state
+   unsigned usableCheckpoints = steps / CHECKPOINT_INTERVAL;
+   if (usableCheckpoints > game->checkpointCount)
+      usableCheckpoints = game->checkpointCount;
+
+   if (usableCheckpoints)
+      memcpy(game->controlledBy, &game->checkpoints[(usableCheckpoints-1) * game->nodeCount],
+             sizeof(game->controlledBy[0]) * game->nodeCount);
+   else
+      memcpy(game->controlledBy, game->controlledByInitial, sizeof(game->controlledByInitial[0]) * game->nodeCount);
+
+   for (unsigned i = usableCheckpoints * CHECKPOINT_INTERVAL; i < steps; ++i)
    {
       resolveTurn(game, i);
+
+      // Past the last checkpoint we know of? Then remember this one for next time.
+      if ((i+1) % CHECKPOINT_INTERVAL == 0 && (i+1) / CHECKPOINT_INTERVAL > game->checkpointCount)
+         storeCheckpoint(game);
    }
 
+#ifdef VERIFY_RESOLUTION
+   verifyAgainstFullReplay(game, steps);
+#endif
+
    // Test the game state for a winner
    unsigned winningPlayer = UINT_MAX;
    for (unsigned node = 0; node < game->nodeCount; ++node)
@@ -257,25 +563,24 @@ void stepGameHistoryLatest(struct GameState* game)
 void calculateDisplayStrengths(struct GameState* game, unsigned turnIndex, float* strength, unsigned* orderCount)
 {
    struct Turn* turn = &game->turn[turnIndex];
+   struct ScratchPosition position = scratchSave(&game->scratch);
+   struct OrderIndex index = buildOrderIndex(game, turn);
 
-   unsigned pinned[game->nodeCount];
+   unsigned* pinned = scratchAlloc(&game->scratch, game->nodeCount * sizeof(pinned[0]));
    findPinnedWorlds(game, turn, pinned);
+   struct SupportMemo memo = buildSupportMemo(game, turn, &index, pinned);
 
    // What's the (offensive) strength of each node
    for (unsigned node = 0; node < game->nodeCount; ++node)
    {
-      fixed_real fixedStrength = calculateStrength(game, turn, node, pinned);
+      fixed_real fixedStrength = calculateStrength(game, turn, &index, &memo, node, pinned);
       float floatStrength = (fixedStrength >> FIXED_SHIFT) +
          ( (float)(fixedStrength & FIXED_MASK) / (float)FIXED_MASK) ;
       strength[node] = floatStrength;
 
       // How many total orders from that same node?
-      unsigned splitOrderCount = 0;
-      for (unsigned order = 0; order < turn->orderCount; ++order)
-      {
-         if (turn->fromNode[order] == node)
-            ++splitOrderCount;
-      }
-      orderCount[node] = splitOrderCount;
+      orderCount[node] = index.fromCount[node];
    }
+
+   scratchRestore(&game->scratch, position);
 }
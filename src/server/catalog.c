@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+
+#define IDSLOT 8
+#define NAMESLOT 64
+
+// Where things are in an entry
+#define NAMEAT IDSLOT
+#define WINNERAT (NAMEAT + NAMESLOT)
+#define STATEAT (WINNERAT + NAMESLOT)
+#define PLAYERCOUNTAT (STATEAT + 4)
+
+static void putSlot(unsigned char* slot, const char* string, size_t width)
+{
+   size_t length = strlen(string);
+   memset(slot, 0, width);
+   memcpy(slot, string, length < width - 1 ? length : width - 1);
+}
+
+static void putWord(unsigned char* bytes, uint32_t word)
+{
+   for (unsigned i = 0; i < 4; ++i)
+      bytes[i] = (word >> (8 * i)) & 0xff;
+}
+
+static uint32_t getWord(const unsigned char* bytes)
+{
+   return bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void makeEntry(const struct GameState* game, unsigned char entry[CATALOGENTRYSIZE])
+{
+   putSlot(entry, game->id, IDSLOT);
+   putSlot(entry + NAMEAT, game->gameName, NAMESLOT);
+   putSlot(entry + WINNERAT, game->winningPlayer < game->playerCount ? game->playerName[game->winningPlayer] : "",
+           NAMESLOT);
+   putWord(entry + STATEAT, game->metaGameState);
+   putWord(entry + PLAYERCOUNTAT, game->playerCount);
+}
+
+// Opens the catalog and takes the lock, -1 if that did not work
+static int openCatalog(const char* path, int flags, int operation)
+{
+   int fd = open(path, flags, 0644);
+   if (fd == -1)
+      return -1;
+   if (flock(fd, operation))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+static void closeCatalog(int fd)
+{
+   flock(fd, LOCK_UN);
+   close(fd);
+}
+
+// Whether the catalog has a header of this form, and if so whether it holds
+// every game
+static int readHeader(int fd, int* complete)
+{
+   unsigned char header[CATALOGHEADERSIZE];
+   if (pread(fd, header, CATALOGHEADERSIZE, 0) != CATALOGHEADERSIZE || memcmp(header, CATALOGMAGIC, 4))
+      return 0;
+   *complete = getWord(header + 4) == 1;
+   return 1;
+}
+
+static int writeHeader(int fd, int complete)
+{
+   unsigned char header[CATALOGHEADERSIZE];
+   memcpy(header, CATALOGMAGIC, 4);
+   putWord(header + 4, complete);
+   return pwrite(fd, header, CATALOGHEADERSIZE, 0) == CATALOGHEADERSIZE;
+}
+
+int updateCatalog(const char* path, const struct GameState* game)
+{
+   // Not made here, as a catalog of just this game would leave out the rest
+   int fd = openCatalog(path, O_RDWR, LOCK_EX);
+   if (fd == -1)
+      return errno == ENOENT;
+   struct stat st;
+   int complete;
+   if (!readHeader(fd, &complete))
+   {
+      closeCatalog(fd);
+      return 1;
+   }
+   if (fstat(fd, &st))
+   {
+      closeCatalog(fd);
+      return 0;
+   }
+   size_t count = (st.st_size - CATALOGHEADERSIZE) / CATALOGENTRYSIZE;
+
+   unsigned char entry[CATALOGENTRYSIZE];
+   makeEntry(game, entry);
+
+   // Where the entry is, or should go: the first one with an id not before it
+   size_t low = 0, high = count;
+   int found = 0;
+   while (low < high)
+   {
+      size_t middle = low + (high - low) / 2;
+      char id[IDSLOT];
+      if (pread(fd, id, IDSLOT, CATALOGHEADERSIZE + (off_t)middle * CATALOGENTRYSIZE) != IDSLOT)
+      {
+         closeCatalog(fd);
+         return 0;
+      }
+      int order = strncmp(id, (const char*)entry, IDSLOT);
+      if (order < 0)
+         low = middle + 1;
+      else
+      {
+         found = order == 0;
+         high = middle;
+      }
+   }
+
+   int written = 1;
+   off_t at = CATALOGHEADERSIZE + (off_t)low * CATALOGENTRYSIZE;
+   if (!found && low < count)
+   {
+      // Make room, by moving everything after it one entry along
+      size_t tailSize = (count - low) * CATALOGENTRYSIZE;
+      unsigned char* tail = malloc(tailSize);
+      written = pread(fd, tail, tailSize, at) == (ssize_t)tailSize &&
+         pwrite(fd, tail, tailSize, at + CATALOGENTRYSIZE) == (ssize_t)tailSize;
+      free(tail);
+   }
+   written = written && pwrite(fd, entry, CATALOGENTRYSIZE, at) == CATALOGENTRYSIZE;
+   closeCatalog(fd);
+   return written;
+}
+
+int clearCatalog(const char* path)
+{
+   int fd = openCatalog(path, O_RDWR | O_CREAT, LOCK_EX);
+   if (fd == -1)
+      return 0;
+   int cleared = !ftruncate(fd, 0) && writeHeader(fd, 0);
+   closeCatalog(fd);
+   return cleared;
+}
+
+int completeCatalog(const char* path)
+{
+   int fd = openCatalog(path, O_RDWR, LOCK_EX);
+   if (fd == -1)
+      return 0;
+   int completed = writeHeader(fd, 1);
+   closeCatalog(fd);
+   return completed;
+}
+
+int printCatalog(const char* path, FILE* f)
+{
+   int fd = openCatalog(path, O_RDONLY, LOCK_SH);
+   if (fd == -1)
+      return 0;
+   struct stat st;
+   int complete;
+   if (!readHeader(fd, &complete) || !complete || fstat(fd, &st))
+   {
+      closeCatalog(fd);
+      return 0;
+   }
+   size_t size = (st.st_size - CATALOGHEADERSIZE) - (st.st_size - CATALOGHEADERSIZE) % CATALOGENTRYSIZE;
+   unsigned char* data = malloc(size ? size : 1);
+   size_t got = 0;
+   ssize_t chunk;
+   while (got < size && (chunk = pread(fd, data + got, size - got, CATALOGHEADERSIZE + got)) > 0)
+      got += chunk;
+   closeCatalog(fd);
+
+   size_t count = got / CATALOGENTRYSIZE;
+   fprintf(f, "%zu\n", count);
+   for (size_t i = 0; i < count; ++i)
+   {
+      unsigned char* entry = data + i * CATALOGENTRYSIZE;
+      // The slots are written ending in 0, but don't count on it
+      entry[IDSLOT - 1] = entry[WINNERAT - 1] = entry[STATEAT - 1] = 0;
+      fprintf(f, "%s\n%s\n%u\n%u\n%s\n", (const char*)entry, (const char*)entry + NAMEAT,
+              getWord(entry + STATEAT), getWord(entry + PLAYERCOUNTAT), (const char*)entry + WINNERAT);
+   }
+   free(data);
+   return 1;
+}
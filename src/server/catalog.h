@@ -0,0 +1,49 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdio.h>
+
+#include "../common/game.h"
+
+/*
+  The catalog holds what the list of games shows of each game (its id, name,
+  state, player count and the name of the winner), so that listing the games
+  does not mean reading every one of them.
+
+  It is a file of CATALOGENTRYSIZE byte entries, sorted by game id, so that an
+  entry can be found (and written over) without reading the rest. Each entry
+  is the id, the game name and the winner's name in 8, 64 and 64 byte slots
+  ending in 0, then the state and the player count as 32 bit little-endian
+  numbers. Writers take an exclusive flock on the file, readers a shared one.
+
+  The entries follow a CATALOGHEADERSIZE byte header: CATALOGMAGIC, then a 32
+  bit number that is 1 once the catalog holds every game (it is 0 while it
+  is being made from the game files). A catalog is only ever made whole, by
+  clearCatalog() and completeCatalog(), so one that is missing, incomplete or
+  of another form is not to be trusted and needs making anew.
+*/
+
+#define CATALOGMAGIC "OWC\x01"
+#define CATALOGHEADERSIZE 8
+#define CATALOGENTRYSIZE 144
+
+// Brings the entry of 'game' in the catalog at 'path' up to date, adding it
+// if it is not there yet. A catalog that is missing (or of another form) is
+// left alone, as it needs making anew anyway. Returns 0 if the catalog could
+// not be written.
+int updateCatalog(const char* path, const struct GameState* game);
+
+// Empties the catalog at 'path' (making it, if there is none), for it to be
+// filled again with updateCatalog(), which is quickest in order of game id,
+// and then marked as holding every game with completeCatalog(). Returns 0 if
+// it could not be written.
+int clearCatalog(const char* path);
+int completeCatalog(const char* path);
+
+// Prints the catalog at 'path' as the list of games: the number of games,
+// then the id, name, state, player count and winner's name (an empty line if
+// there is none) of each, a line apiece. Returns 0, having printed nothing,
+// if there is no complete catalog.
+int printCatalog(const char* path, FILE* f);
+
+#endif
@@ -8,37 +8,14 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <math.h>
 
 #include "../common/game.h"
 #include "../common/turnresolution.h"
-
-static int lockFd;
-
-static void unlock()
-{
-   if (flock(lockFd, LOCK_UN))
-   {
-      printf("File unlock error.");
-      exit(-1);
-   }
-   close(lockFd);
-}
-
-static void ensureOnlyInstance()
-{
-   lockFd = open("/tmp/officewars.lock", O_RDWR | O_CREAT, S_IRWXU);
-   if (lockFd == -1)
-   {
-      printf("File open error.");
-      exit(-1);
-   }
-   if (flock(lockFd, LOCK_EX))
-   {
-      printf("File lock error.");
-      exit(-1);
-   }
-   atexit(unlock);
-}
+#include "../common/parallel.h"
+#include "../common/gamefile.h"
+#include "catalog.h"
 
 // Generate a 6 char key, to use as an access key or game id
 static void generateKey(char key[7])
@@ -52,6 +29,11 @@ static void generateKey(char key[7])
    key[6] = '\0';
 }
 
+static uint64_t generateSeed()
+{
+   return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+}
+
 static void exitWithError(int code)
 {
    fprintf(stderr, "Controlled error out with code %d\n", code);
@@ -59,25 +41,94 @@ static void exitWithError(int code)
    exit(-1);
 }
 
-static void createNewGameFile(const char* gameName)
+// Holds a flock on 'path' (made, if there is none) for as long as the returned
+// descriptor is open, or -1 if it could not be had
+static int lockFile(const char* path, int operation)
 {
-   if (strlen(gameName) > 63 || strlen(gameName) < 1)
-      exitWithError(400);
-   FILE* gameFile = NULL;
-   char id[7];
-   while (!gameFile)
+   int fd = open(path, O_RDONLY | O_CREAT, 0644);
+   if (fd == -1)
+      return -1;
+   if (flock(fd, operation))
    {
-      generateKey(id);  
-      gameFile = fopen(id, "wx");
-      if (!gameFile && errno != EEXIST) exitWithError(500);
+      close(fd);
+      return -1;
    }
+   return fd;
+}
 
+static void unlockFile(int fd)
+{
+   flock(fd, LOCK_UN);
+   close(fd);
+}
+
+// Held, briefly, while a game is made or the catalog made anew, and shared
+// while the games are listed
+static const char* directoryLockPath = ".lock";
+
+static int lockDirectory(int operation)
+{
+   int fd = lockFile(directoryLockPath, operation);
+   if (fd == -1)
+      exitWithError(500);
+   return fd;
+}
+
+// The list of games, see catalog.h. Kept up to date by every write of a game.
+static const char* catalogPath = ".catalog";
+
+// Games are kept in shards, by the first two letters of their ids (the game
+// ABCDEF is AB/ABCDEF), so that no one directory has to hold all of them. The
+// files that go with a game are next to it, named after it: 'suffix' ".lock"
+// gives AB/.ABCDEF.lock. A NULL 'suffix' gives the game file itself.
+static void gamePath(const char id[7], const char* suffix, char path[24])
+{
+   if (suffix)
+      snprintf(path, 24, "%.2s/.%s%s", id, id, suffix);
+   else
+      snprintf(path, 24, "%.2s/%s", id, id);
+}
+
+static void makeShard(const char id[7])
+{
+   char shard[3] = {id[0], id[1], '\0'};
+   if (mkdir(shard, 0755) && errno != EEXIST)
+      exitWithError(500);
+}
+
+static void createNewGameFile(const char* gameName)
+{
+   if (strlen(gameName) > 63 || strlen(gameName) < 1)
+      exitWithError(400);
+   int directoryLock = lockDirectory(LOCK_EX);
    struct GameState game = initatePreGame(gameName);
-   strcpy(game.id, id);
+   game.seed = generateSeed();
 
-   serialize(&game, -1, gameFile);
+   // Written next to where it goes and then linked into place, so that nobody
+   // sees the game half written (and no other game is written over)
+   int created = 0;
+   while (!created)
+   {
+      generateKey(game.id);
+      makeShard(game.id);
+      char newPath[24], path[24];
+      gamePath(game.id, ".new", newPath);
+      gamePath(game.id, NULL, path);
+      FILE* gameFile = fopen(newPath, "w");
+      if (!gameFile)
+         exitWithError(500);
+      writeGameFile(&game, gameFile);
+      fclose(gameFile);
+      created = !link(newPath, path);
+      int linkError = errno;
+      unlink(newPath);
+      if (!created && linkError != EEXIST)
+         exitWithError(500);
+   }
 
-   fclose(gameFile);
+   if (!updateCatalog(catalogPath, &game))
+      exitWithError(500);
+   unlockFile(directoryLock);
 }
 
 static int validateId(const char* id)
@@ -92,148 +143,600 @@ static int validateId(const char* id)
    return 1;
 }
 
+// Orders are appended to the journal of a game until it holds this many bytes,
+// after which the next order has the whole game written out instead
+static const long journalFoldSize = 64 * 1024;
+
+// How many bytes of orders are waiting in the journal of a game
+static long journalSize(const char id[7])
+{
+   char path[24];
+   gamePath(id, ".journal", path);
+   struct stat st;
+   return stat(path, &st) ? 0 : st.st_size;
+}
+
+// Reads a game, with the orders in its journal given again. Returns 0 if it
+// could not be read, with nothing in 'game' left to free.
+static int readGame(const char id[7], struct GameState* game)
+{
+   char path[24];
+   gamePath(id, NULL, path);
+   FILE* gameFile = fopen(path, "r");
+   if (!gameFile)
+      return 0;
+   int read = readGameFile(gameFile, game);
+   fclose(gameFile);
+   if (!read)
+   {
+      freeGameState(game);
+      return 0;
+   }
+   gamePath(id, ".journal", path);
+   replayJournal(path, game);
+   return 1;
+}
+
 static struct GameState loadGame(const char id[7])
 {
    if (!validateId(id))
       exitWithError(400);
-   FILE* gameFile = fopen(id, "r");
-   if (!gameFile)
-   {
+   struct GameState game;
+   if (!readGame(id, &game))
       exitWithError(500);
-   }
-   struct GameState game = deserialize(gameFile);
-   fclose(gameFile);
    return game;
 }
 
-static void saveAndCloseGame(struct GameState* game, const char id[7])
+// For requests that only look at the game: the file is mapped rather than
+// read (unless there are orders in its journal, which need a copy to go into),
+// and the game must not be changed or saved
+static struct GameState loadGameReadOnly(const char id[7])
 {
-   FILE* newGameFile = fopen(id, "w");
-   serialize(game, -1, newGameFile);
-   fclose(newGameFile);
+   if (!validateId(id))
+      exitWithError(400);
+   if (journalSize(id) > 0)
+      return loadGame(id);
+   char path[24];
+   gamePath(id, NULL, path);
+   struct GameState game;
+   if (!mapGameFile(path, &game))
+      exitWithError(500);
+   return game;
+}
+
+// The new file is written next to the old one and then put in its place, so
+// that whoever has the old one mapped keeps seeing all of it. The orders in
+// the journal are in it now, so the journal goes (and should that not happen,
+// the new journal sequence has it left alone anyway). Returns 0 if it could
+// not be saved; the game is freed either way.
+static int saveGame(struct GameState* game, const char id[7])
+{
+   ++game->journalSequence;
+   char newPath[24], path[24];
+   gamePath(id, ".new", newPath);
+   gamePath(id, NULL, path);
+   FILE* newGameFile = fopen(newPath, "w");
+   int saved = newGameFile != NULL;
+   if (saved)
+   {
+      writeGameFile(game, newGameFile);
+      fclose(newGameFile);
+      saved = !rename(newPath, path);
+   }
+   if (saved)
+   {
+      gamePath(id, ".journal", path);
+      unlink(path);
+      saved = updateCatalog(catalogPath, game);
+   }
    freeGameState(game);
+   return saved;
 }
 
-static void tickAllGames()
+static void saveAndCloseGame(struct GameState* game, const char id[7])
 {
-   DIR *d;
-   struct dirent *dir;
-   d = opendir(".");
-   if (d)
+   if (!saveGame(game, id))
+      exitWithError(500);
+}
+
+// Each game has a lock file of its own, so that requests on different games
+// go ahead side by side (the game file is replaced whenever it is saved, so it
+// can't hold the lock itself). Whatever changes the game takes it exclusively
+// (LOCK_EX), whatever only looks at it shares it (LOCK_SH) with the others
+// that only look. -1 if there is no such game.
+static int lockGame(const char id[7], int operation)
+{
+   if (!validateId(id))
+      exitWithError(400);
+   char path[24];
+   gamePath(id, NULL, path);
+   if (access(path, F_OK))
+      return -1;
+   gamePath(id, ".lock", path);
+   return lockFile(path, operation);
+}
+
+// For commands and requests on a single game, which keep the lock until they
+// exit
+static void lockGameOrExit(const char id[7], int operation)
+{
+   if (lockGame(id, operation) == -1)
+      exitWithError(500);
+}
+
+static int isShard(const char* name)
+{
+   return strlen(name) == 2 && name[0] >= 'A' && name[0] <= 'Z' && name[1] >= 'A' && name[1] <= 'Z';
+}
+
+// The ids of all games, from every shard, in no particular order
+static unsigned listGames(char (**id)[7])
+{
+   unsigned gameCount = 0;
+   *id = NULL;
+   DIR* games = opendir(".");
+   if (!games)
+      return 0;
+   struct dirent* shard;
+   while ((shard = readdir(games)) != NULL)
    {
+      if (!isShard(shard->d_name))
+         continue;
+      DIR* d = opendir(shard->d_name);
+      if (!d)
+         continue;
+      struct dirent* dir;
       while ((dir = readdir(d)) != NULL)
       {
-         if (strncmp(dir->d_name, ".", 1) && strncmp(dir->d_name, "..", 2)) // ignore . and ..
+         if (validateId(dir->d_name) && !strncmp(dir->d_name, shard->d_name, 2))
          {
-            struct GameState game = loadGame(dir->d_name);
-            stepGameHistoryLatest(&game);
-            tickGame(&game);
-            saveAndCloseGame(&game, dir->d_name);
+            *id = realloc(*id, (gameCount+1) * sizeof((*id)[0]));
+            strcpy((*id)[gameCount], dir->d_name);
+            ++gameCount;
          }
       }
       closedir(d);
    }
+   closedir(games);
+   return gameCount;
 }
 
-static void startAllGames()
+// Moves the games kept the old way, all in the one directory, into their
+// shards
+static void shardGames()
 {
-   DIR *d;
-   struct dirent *dir;
-   d = opendir(".");
+   int directoryLock = lockDirectory(LOCK_EX);
+   unsigned movedCount = 0;
+   DIR* d = opendir(".");
    if (d)
    {
+      struct dirent* dir;
       while ((dir = readdir(d)) != NULL)
       {
-         if (strncmp(dir->d_name, ".", 1) && strncmp(dir->d_name, "..", 2)) // ignore . and ..
-         {
-            struct GameState game = loadGame(dir->d_name);
-            startGame(&game);
-            saveAndCloseGame(&game, dir->d_name);
-         }
+         if (!validateId(dir->d_name))
+            continue;
+         char id[7];
+         strcpy(id, dir->d_name);
+
+         // Under the lock that servers from before shards take
+         char oldPath[16];
+         snprintf(oldPath, sizeof(oldPath), ".%s.lock", id);
+         int lock = lockFile(oldPath, LOCK_EX);
+         if (lock == -1)
+            exitWithError(500);
+
+         // The journal goes first, so that the game is never seen without it
+         makeShard(id);
+         char path[24];
+         snprintf(oldPath, sizeof(oldPath), ".%s.journal", id);
+         gamePath(id, ".journal", path);
+         if (rename(oldPath, path) && errno != ENOENT)
+            exitWithError(500);
+         gamePath(id, NULL, path);
+         if (rename(id, path))
+            exitWithError(500);
+
+         snprintf(oldPath, sizeof(oldPath), ".%s.lock", id);
+         unlink(oldPath);
+         unlockFile(lock);
+         ++movedCount;
       }
       closedir(d);
    }
+   // Left incomplete, so that the next listing makes it anew from the shards
+   // (a catalog made before they were there has none of the games moved)
+   if (!clearCatalog(catalogPath))
+      exitWithError(500);
+   unlockFile(directoryLock);
+   printf("%u games moved into shards\n", movedCount);
+}
+
+static double secondsSince(struct timespec start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
 }
 
+struct TickSweep
+{
+   unsigned gameCount;
+   char (*id)[7];
+   double* seconds;
 
-static void addRandomAI()
+   pthread_mutex_t mutex;
+   unsigned nextGame;
+};
+
+static void* tickWorker(void* arg)
 {
-   DIR *d;
-   struct dirent *dir;
-   d = opendir(".");
-   if (d)
+   struct TickSweep* sweep = arg;
+   while (1)
    {
-      while ((dir = readdir(d)) != NULL)
+      pthread_mutex_lock(&sweep->mutex);
+      unsigned game = sweep->nextGame++;
+      pthread_mutex_unlock(&sweep->mutex);
+      if (game >= sweep->gameCount)
+         return NULL;
+
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      int lock = lockGame(sweep->id[game], LOCK_EX);
+      if (lock == -1)
       {
-         if (strncmp(dir->d_name, ".", 1) && strncmp(dir->d_name, "..", 2)) // ignore . and ..
-         {
-            struct GameState game = loadGame(dir->d_name);
+         sweep->seconds[game] = -1.0;
+         continue;
+      }
+      // A game that can't be read or saved is passed over, rather than
+      // stopping the ticks of all the others
+      struct GameState state;
+      int ticked = readGame(sweep->id[game], &state);
+      if (ticked)
+      {
+         stepGameHistoryLatest(&state);
+         tickGame(&state);
+         ticked = saveGame(&state, sweep->id[game]);
+      }
+      unlockFile(lock);
+
+      if (!ticked)
+         fprintf(stderr, "%s could not be ticked\n", sweep->id[game]);
+      sweep->seconds[game] = ticked ? secondsSince(start) : -1.0;
+   }
+}
 
-            char playerSecret[7] = {0};
-            generateKey(playerSecret);
-            char name[32] = {0};
-            char color[8] = {0};
-            snprintf(name, 31, "random%d", rand());
-            snprintf(color, 8, "#%02x%02x%02x", rand()%256, rand()%256, rand()%256);
-            addPlayer(&game, name, color, playerSecret);
+// Ticks every game, 'workerCount' games at a time, and reports how long each took
+static void tickAllGames(unsigned workerCount)
+{
+   struct TickSweep sweep = {0};
+   pthread_mutex_init(&sweep.mutex, NULL);
 
-            saveAndCloseGame(&game, dir->d_name);
-         }
+   sweep.gameCount = listGames(&sweep.id);
+   sweep.seconds = calloc(sweep.gameCount, sizeof(sweep.seconds[0]));
+
+   struct timespec start;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   if (workerCount > sweep.gameCount)
+      workerCount = sweep.gameCount;
+   pthread_t* workers = malloc(workerCount * sizeof(workers[0]));
+   for (unsigned i = 0; i < workerCount; ++i)
+   {
+      if (pthread_create(&workers[i], NULL, tickWorker, &sweep))
+         exitWithError(500);
+   }
+   for (unsigned i = 0; i < workerCount; ++i)
+   {
+      pthread_join(workers[i], NULL);
+   }
+
+   // One line per game (a negative time means it could not be locked or
+   // ticked), then the total
+   for (unsigned i = 0; i < sweep.gameCount; ++i)
+   {
+      printf("%s %.6f\n", sweep.id[i], sweep.seconds[i]);
+   }
+   printf("total %u %u %.6f\n", sweep.gameCount, workerCount, secondsSince(start));
+
+   pthread_mutex_destroy(&sweep.mutex);
+   free(workers);
+   free(sweep.id);
+   free(sweep.seconds);
+}
+
+// Generates the map of a started game again, from its seed, and checks that
+// it comes out exactly as stored. Returns 0 if it does.
+static int regenerateGame(const char id[7])
+{
+   struct GameState game = loadGame(id);
+   if (game.metaGameState == PREGAME)
+   {
+      printf("%s has not started, there is no map yet\n", id);
+      freeGameState(&game);
+      return 1;
+   }
+
+   struct GameState regenerated = initatePreGame(game.gameName);
+   strcpy(regenerated.id, game.id);
+   regenerated.seed = game.seed;
+   for (unsigned i = 0; i < game.playerCount; ++i)
+   {
+      char color[8];
+      strcpy(color, game.playerColor[i]);
+      addPlayer(&regenerated, game.playerName[i], color, game.playerSecret[i]);
+   }
+   startGame(&regenerated);
+
+   const char* difference = NULL;
+   if (regenerated.nodeCount != game.nodeCount)
+      difference = "node count";
+   else if (memcmp(regenerated.adjacencyOffsets, game.adjacencyOffsets, sizeof(game.adjacencyOffsets[0]) * (game.nodeCount + 1)) ||
+            memcmp(regenerated.adjacencyList, game.adjacencyList, sizeof(game.adjacencyList[0]) * game.adjacencyOffsets[game.nodeCount]))
+      difference = "edges";
+   else if (memcmp(regenerated.controlledByInitial, game.controlledByInitial, sizeof(game.controlledByInitial[0]) * game.nodeCount))
+      difference = "starting positions";
+   else
+   {
+      // Positions are only stored with 5 decimals
+      for (unsigned node = 0; node < game.nodeCount && !difference; ++node)
+      {
+         if (fabsf(regenerated.nodeSpacePositions[node].x - game.nodeSpacePositions[node].x) > 0.00001f ||
+             fabsf(regenerated.nodeSpacePositions[node].y - game.nodeSpacePositions[node].y) > 0.00001f ||
+             fabsf(regenerated.nodeSpacePositions[node].z - game.nodeSpacePositions[node].z) > 0.00001f)
+            difference = "node positions";
       }
-      closedir(d);
    }
+
+   if (difference)
+      printf("%s differs when regenerated from seed %llu: %s\n", id, (unsigned long long)game.seed, difference);
+   else
+      printf("%s is identical when regenerated from seed %llu\n", id, (unsigned long long)game.seed);
+
+   freeGameState(&regenerated);
+   freeGameState(&game);
+   return difference != NULL;
+}
+
+// Maps made in advance, so that starting a game need not wait for map
+// generation. One directory per player count, next to the games directory.
+// Maps are written under a dot name and renamed into place when complete, and
+// claimed by renaming them away, so nobody ever reads half a map or takes one
+// that someone else took.
+static const char* mapPoolDirectory = "../mappool";
+static const unsigned pooledPlayerCountMin = 2;
+static const unsigned pooledPlayerCountMax = 16;
+static const unsigned pooledMapsPerPlayerCount = 3;
+
+static void fillMapPool(unsigned playerCount, unsigned wanted)
+{
+   char directory[64];
+   snprintf(directory, sizeof(directory), "%s/%u", mapPoolDirectory, playerCount);
+   if ((mkdir(mapPoolDirectory, 0755) && errno != EEXIST) ||
+       (mkdir(directory, 0755) && errno != EEXIST))
+      exitWithError(500);
+
+   unsigned pooled = 0;
+   DIR* d = opendir(directory);
+   if (!d)
+      exitWithError(500);
+   struct dirent* dir;
+   while ((dir = readdir(d)) != NULL)
+   {
+      if (dir->d_name[0] != '.') // ignore ., .. and maps being written or claimed
+         ++pooled;
+   }
+   closedir(d);
+
+   for (; pooled < wanted; ++pooled)
+   {
+      struct GameState map = {0};
+      map.playerCount = playerCount;
+      map.seed = generateSeed();
+      generateMap(&map);
+
+      char path[128];
+      char writtenPath[128];
+      snprintf(path, sizeof(path), "%s/%llu", directory, (unsigned long long)map.seed);
+      snprintf(writtenPath, sizeof(writtenPath), "%s/.%llu", directory, (unsigned long long)map.seed);
+      FILE* mapFile = fopen(writtenPath, "w");
+      if (!mapFile)
+         exitWithError(500);
+      serializeMap(&map, mapFile);
+      if (fclose(mapFile) || rename(writtenPath, path))
+         exitWithError(500);
+      freeGameState(&map);
+   }
+}
+
+// Hands the game a map from the pool, if there is one for its player count.
+// Returns 0 if there was none.
+static int claimPooledMap(struct GameState* game)
+{
+   char directory[64];
+   snprintf(directory, sizeof(directory), "%s/%u", mapPoolDirectory, game->playerCount);
+   DIR* d = opendir(directory);
+   if (!d)
+      return 0;
+
+   int claimed = 0;
+   struct dirent* dir;
+   while (!claimed && (dir = readdir(d)) != NULL)
+   {
+      if (dir->d_name[0] == '.')
+         continue;
+
+      char path[sizeof(directory) + sizeof(dir->d_name)];
+      char claimedPath[128];
+      snprintf(path, sizeof(path), "%s/%s", directory, dir->d_name);
+      snprintf(claimedPath, sizeof(claimedPath), "%s/.claimed%d", directory, (int)getpid());
+      if (rename(path, claimedPath))
+         continue; // Somebody else got it first
+
+      FILE* mapFile = fopen(claimedPath, "r");
+      if (mapFile)
+      {
+         claimed = deserializeMap(game, mapFile);
+         fclose(mapFile);
+      }
+      unlink(claimedPath);
+   }
+   closedir(d);
+   return claimed;
+}
+
+static void startGameFromPool(struct GameState* game)
+{
+   if (game->metaGameState == PREGAME && game->playerCount > 0)
+      claimPooledMap(game);
+   startGame(game);
+}
+
+// Rewrites every game file in the binary form (game files in the text form,
+// from before there was a binary one, are read just fine, but slowly)
+static void convertAllGames()
+{
+   char (*id)[7];
+   unsigned gameCount = listGames(&id);
+   for (unsigned i = 0; i < gameCount; ++i)
+   {
+      int lock = lockGame(id[i], LOCK_EX);
+      if (lock == -1)
+         continue;
+      struct GameState game = loadGame(id[i]);
+      saveAndCloseGame(&game, id[i]);
+      unlockFile(lock);
+   }
+   free(id);
+}
+
+static int compareIds(const void* a, const void* b)
+{
+   return strcmp(a, b);
+}
+
+// Makes the catalog anew from the game files, for games from before there was
+// one (or if it got lost, or was left incomplete)
+static void rebuildCatalog()
+{
+   // Taken before the games are listed, so that no game can be made after
+   // being left out of the list
+   int directoryLock = lockDirectory(LOCK_EX);
+   char (*id)[7];
+   unsigned gameCount = listGames(&id);
+
+   // In order, so that every game goes at the end (there being no list at all
+   // without games)
+   if (gameCount)
+      qsort(id, gameCount, sizeof(id[0]), compareIds);
+   if (!clearCatalog(catalogPath))
+      exitWithError(500);
+   for (unsigned i = 0; i < gameCount; ++i)
+   {
+      int lock = lockGame(id[i], LOCK_SH);
+      if (lock == -1)
+         continue;
+      struct GameState game = loadGameReadOnly(id[i]);
+      if (!updateCatalog(catalogPath, &game))
+         exitWithError(500);
+      freeGameState(&game);
+      unlockFile(lock);
+   }
+   if (!completeCatalog(catalogPath))
+      exitWithError(500);
+   unlockFile(directoryLock);
+   free(id);
+}
+
+static void startAllGames()
+{
+   char (*id)[7];
+   unsigned gameCount = listGames(&id);
+   for (unsigned i = 0; i < gameCount; ++i)
+   {
+      int lock = lockGame(id[i], LOCK_EX);
+      if (lock == -1)
+         continue;
+      struct GameState game = loadGame(id[i]);
+      startGameFromPool(&game);
+      saveAndCloseGame(&game, id[i]);
+      unlockFile(lock);
+   }
+   free(id);
+}
+
+
+static void addRandomAI()
+{
+   char (*id)[7];
+   unsigned gameCount = listGames(&id);
+   for (unsigned i = 0; i < gameCount; ++i)
+   {
+      int lock = lockGame(id[i], LOCK_EX);
+      if (lock == -1)
+         continue;
+      struct GameState game = loadGame(id[i]);
+
+      char playerSecret[7] = {0};
+      generateKey(playerSecret);
+      char name[32] = {0};
+      char color[8] = {0};
+      snprintf(name, 31, "random%d", rand());
+      snprintf(color, 8, "#%02x%02x%02x", rand()%256, rand()%256, rand()%256);
+      addPlayer(&game, name, color, playerSecret);
+
+      saveAndCloseGame(&game, id[i]);
+      unlockFile(lock);
+   }
+   free(id);
 }
 
 static void moveRandomAI()
 {
-   DIR *d;
-   struct dirent *dir;
-   d = opendir(".");
-   if (d)
+   char (*id)[7];
+   unsigned gameCount = listGames(&id);
+   for (unsigned i = 0; i < gameCount; ++i)
    {
-      while ((dir = readdir(d)) != NULL)
+      int lock = lockGame(id[i], LOCK_EX);
+      if (lock == -1)
+         continue;
+      struct GameState game = loadGame(id[i]);
+      stepGameHistoryLatest(&game);
+
+      unsigned* connected = scratchAlloc(&game.scratch, game.nodeCount * sizeof(connected[0]));
+      for (unsigned node = 0; node < game.nodeCount; ++node)
       {
-         if (strncmp(dir->d_name, ".", 1) && strncmp(dir->d_name, "..", 2)) // ignore . and ..
+         unsigned playerId = game.controlledBy[node];
+         if (playerId != 4294967295)
          {
-            struct GameState game = loadGame(dir->d_name);
-            stepGameHistoryLatest(&game);
-
-            for (unsigned node = 0; node < game.nodeCount; ++node)
-            {
-               unsigned playerId = game.controlledBy[node];
-               if (playerId != 4294967295)
-               {
-                  const char* name = game.playerName[playerId];
-                  if (strncmp(name, "random", strlen("random")))
-                     continue;
+            const char* name = game.playerName[playerId];
+            if (strncmp(name, "random", strlen("random")))
+               continue;
 		  
-                  char* secret = game.playerSecret[playerId];
+            char* secret = game.playerSecret[playerId];
 
-                  unsigned connected[game.nodeCount];
-                  unsigned connectedCount = 0;
-                  getConnectedNodes(&game, node, connected, &connectedCount);
-                  unsigned randomTarget = connected[rand() % connectedCount];
+            unsigned connectedCount = 0;
+            getConnectedNodes(&game, node, connected, &connectedCount);
+            unsigned randomTarget = connected[rand() % connectedCount];
 
-                  unsigned type = ATTACKORDER;
+            unsigned type = ATTACKORDER;
 
-                  //printf("Doing order from %u to %u by %u with secret %s\n", node, randomTarget, playerId, secret);
+            //printf("Doing order from %u to %u by %u with secret %s\n", node, randomTarget, playerId, secret);
 		  
-                  addOrder(&game, type, node, randomTarget, secret);
-               }
-            }
-	    
-            saveAndCloseGame(&game, dir->d_name);
+            addOrder(&game, type, node, randomTarget, secret);
          }
       }
-      closedir(d);
+	    
+      saveAndCloseGame(&game, id[i]);
+      unlockFile(lock);
    }
+   free(id);
 }
 
 int main (int argc, char** argv)
 {
    //system("pwd 1>&2 ; whoami 1>&2");
-   ensureOnlyInstance();
-   
+
    // Create games directory if not already done, and cd to it
    struct stat st = {0};
    if (stat("./games", &st) == -1) {
@@ -243,9 +746,22 @@ int main (int argc, char** argv)
 
    srand(time(NULL));
 
+   // Map generation (for start and pool) may use every core
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   setParallelThreadCount(cores > 0 ? cores : 1);
+
    if (argc == 2 && !strcmp(argv[1], "tick"))
    {
-      tickAllGames();
+      tickAllGames(cores > 0 ? cores : 1);
+      return 0;
+   }
+
+   if (argc == 4 && !strcmp(argv[1], "tick") && !strcmp(argv[2], "-j"))
+   {
+      int workerCount = atoi(argv[3]);
+      if (workerCount < 1)
+         exitWithError(400);
+      tickAllGames(workerCount);
       return 0;
    }
 
@@ -257,6 +773,7 @@ int main (int argc, char** argv)
 
    if (argc == 3 && !strcmp(argv[1], "tick"))
    {
+      lockGameOrExit(argv[2], LOCK_EX);
       struct GameState game = loadGame(argv[2]);
       stepGameHistoryLatest(&game);
       tickGame(&game);
@@ -266,12 +783,76 @@ int main (int argc, char** argv)
 
    if (argc == 3 && !strcmp(argv[1], "start"))
    {
+      lockGameOrExit(argv[2], LOCK_EX);
+      struct GameState game = loadGame(argv[2]);
+      startGameFromPool(&game);
+      saveAndCloseGame(&game, argv[2]);
+      return 0;
+   }
+
+   // Tops up the map pool, for the usual player counts or just the one given.
+   // Meant to run in the background (from cron, say), hence the low priority.
+   if ((argc == 2 || argc == 4) && !strcmp(argv[1], "pool"))
+   {
+      nice(10);
+      if (argc == 4)
+      {
+         int playerCount = atoi(argv[2]);
+         int wanted = atoi(argv[3]);
+         if (playerCount < 1 || wanted < 0)
+            exitWithError(400);
+         fillMapPool(playerCount, wanted);
+      }
+      else
+      {
+         for (unsigned playerCount = pooledPlayerCountMin; playerCount <= pooledPlayerCountMax; ++playerCount)
+            fillMapPool(playerCount, pooledMapsPerPlayerCount);
+      }
+      return 0;
+   }
+
+   if (argc == 2 && !strcmp(argv[1], "convert"))
+   {
+      convertAllGames();
+      return 0;
+   }
+
+   if (argc == 3 && !strcmp(argv[1], "convert"))
+   {
+      lockGameOrExit(argv[2], LOCK_EX);
       struct GameState game = loadGame(argv[2]);
-      startGame(&game);
       saveAndCloseGame(&game, argv[2]);
       return 0;
    }
 
+   if (argc == 2 && !strcmp(argv[1], "shard"))
+   {
+      shardGames();
+      return 0;
+   }
+
+   if (argc == 2 && !strcmp(argv[1], "catalog"))
+   {
+      rebuildCatalog();
+      return 0;
+   }
+
+   // Prints a game (secrets and all) in the text form, for reading
+   if (argc == 3 && !strcmp(argv[1], "dump"))
+   {
+      lockGameOrExit(argv[2], LOCK_SH);
+      struct GameState game = loadGame(argv[2]);
+      serialize(&game, -1, stdout);
+      freeGameState(&game);
+      return 0;
+   }
+
+   if (argc == 3 && !strcmp(argv[1], "regenerate"))
+   {
+      lockGameOrExit(argv[2], LOCK_SH);
+      return regenerateGame(argv[2]);
+   }
+
    if (argc == 3 && !strcmp(argv[1], "create"))
    {
       createNewGameFile(argv[2]);
@@ -311,45 +892,28 @@ int main (int argc, char** argv)
    // Interpret and respond
    if (!strcmp(path, "/games"))
    {
-      printf("Content-Type: text/plain\n\n");	    
-
-      // First, the number of games
-      DIR *d;
-      struct dirent *dir;
-      unsigned gameCount = 0;
-      d = opendir(".");
-      if (d)
-      {
-         while ((dir = readdir(d)) != NULL)
-         {
-            if (strncmp(dir->d_name, ".", 1) && strncmp(dir->d_name, "..", 2)) // ignore . and ..
-               ++gameCount;
-         }
-         closedir(d);
-      }
-      printf("%u\n", gameCount); // number of games in list
+      printf("Content-Type: text/plain\n\n");
 
-      // Then, for each game
-      d = opendir(".");
-      if (d)
+      // The catalog has what the list shows of every game, once it is made
+      int directoryLock = lockDirectory(LOCK_SH);
+      int printed = printCatalog(catalogPath, stdout);
+      unlockFile(directoryLock);
+      if (!printed)
       {
-         while ((dir = readdir(d)) != NULL)
-         {
-            if (strncmp(dir->d_name, ".", 1) && strncmp(dir->d_name, "..", 2)) // ignore . and ..
-            {
-               struct GameState game = loadGame(dir->d_name);
-               serialize(&game, -2, stdout); // no secrets
-               freeGameState(&game);
-            }
-         }
-         closedir(d);
+         rebuildCatalog();
+         directoryLock = lockDirectory(LOCK_SH);
+         printed = printCatalog(catalogPath, stdout);
+         unlockFile(directoryLock);
       }
+      if (!printed)
+         exitWithError(500);
    }
    else if (!strncmp(path, "/state/", strlen("/state/")))
    {
       const char* id = path + strlen("/state/");
       const char* playerSecret = data;
-      struct GameState game = loadGame(id);
+      lockGameOrExit(id, LOCK_SH);
+      struct GameState game = loadGameReadOnly(id);
       unsigned serializationFor = -2; // share no secrets
       if (validateId(playerSecret)) // If there's an authed player, let them see their own moves
       {
@@ -383,6 +947,7 @@ int main (int argc, char** argv)
       // Add player to game
       char playerSecret[7] = {0};
       generateKey(playerSecret);
+      lockGameOrExit(gameId, LOCK_EX);
       struct GameState game = loadGame(gameId);
       if (strlen(name) < 2 || strlen(name) > 63)
          exitWithError(400);
@@ -414,11 +979,12 @@ int main (int argc, char** argv)
          fclose(f);
 
          // Open data file and add order
+         lockGameOrExit(gameId, LOCK_EX);
          struct GameState game = loadGame(gameId);
 
          stepGameHistoryLatest(&game);
 
-         addOrder(&game, type, from, to, playerSecret);
+         int taken = addOrder(&game, type, from, to, playerSecret);
 
          unsigned playerId = -2;
          for (unsigned player = 0; player < game.playerCount; ++player)
@@ -432,7 +998,17 @@ int main (int argc, char** argv)
          printf("Content-Type: text/plain\n\n");
          serialize(&game, playerId, stdout);
 
-         saveAndCloseGame(&game, gameId);
+         // Only the order is written, unless the journal has grown too long (and
+         // an order that was turned down isn't written at all)
+         char path[24];
+         gamePath(gameId, ".journal", path);
+         if (playerId == (unsigned)-2 || !taken)
+            freeGameState(&game);
+         else if (journalSize(gameId) < journalFoldSize &&
+                  appendToJournal(path, &game, playerId, type, from, to))
+            freeGameState(&game);
+         else
+            saveAndCloseGame(&game, gameId);
       }
    }
    else